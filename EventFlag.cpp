@@ -22,7 +22,6 @@
 #include <sys/syscall.h>
 #include <unistd.h>
 #include <utils/Log.h>
-#include <utils/SystemClock.h>
 #include <new>
 
 namespace android {
@@ -69,6 +68,22 @@ status_t EventFlag::createEventFlag(std::atomic<uint32_t>* fwAddr,
     return status;
 }
 
+status_t EventFlag::createEventFlag(std::atomic<uint32_t>* fwAddr,
+                                    EventFlag** flag,
+                                    bool trackWaiters) {
+    status_t status = createEventFlag(fwAddr, flag);
+    /*
+     * Threads may already wait on the word without having registered, so
+     * all the waiter bits are set along with the mode bit. wake() clears
+     * them as it wakes those threads up.
+     */
+    if (status == NO_ERROR && trackWaiters &&
+        (fwAddr->load(std::memory_order_relaxed) & kTrackWaitersBit) == 0) {
+        std::atomic_fetch_or(fwAddr, kTrackWaitersBit | (kEventBitsMask << kWaiterBitsShift));
+    }
+    return status;
+}
+
 /*
  * mmap memory for the futex word
  */
@@ -104,6 +119,30 @@ EventFlag::EventFlag(std::atomic<uint32_t>* fwAddr, status_t* status) {
  * thread waiting on any of the bits.
  */
 status_t EventFlag::wake(uint32_t bitmask) {
+    return wakeHelper(bitmask, INT_MAX, nullptr);
+}
+
+status_t EventFlag::wake(uint32_t bitmask, bool* syscalled) {
+    return wakeHelper(bitmask, INT_MAX, syscalled);
+}
+
+/*
+ * Set bits in the event flag word and wake up a single thread waiting on
+ * them.
+ */
+status_t EventFlag::wakeOne(uint32_t bitmask) {
+    return wakeHelper(bitmask, 1, nullptr);
+}
+
+status_t EventFlag::wakeOne(uint32_t bitmask, bool* syscalled) {
+    return wakeHelper(bitmask, 1, syscalled);
+}
+
+status_t EventFlag::wakeHelper(uint32_t bitmask, int numWaiters, bool* syscalled) {
+    if (syscalled != nullptr) {
+        *syscalled = false;
+    }
+
     /*
      * Return early if there are no set bits in bitmask.
      */
@@ -111,15 +150,42 @@ status_t EventFlag::wake(uint32_t bitmask) {
         return NO_ERROR;
     }
 
+    uint32_t old = mEfWordPtr->load(std::memory_order_relaxed);
+    bool trackWaiters = (old & kTrackWaitersBit) != 0;
+    if (trackWaiters && (bitmask & ~kEventBitsMask) != 0) {
+        return BAD_VALUE;
+    }
+
     status_t status = NO_ERROR;
-    uint32_t old = std::atomic_fetch_or(mEfWordPtr, bitmask);
+    uint32_t waiterBits = 0;
+    if (trackWaiters) {
+        /*
+         * Waking up all the waiters on the bits also unregisters them. A
+         * waiter which registers afterwards finds the bits set and does not
+         * go to sleep.
+         */
+        waiterBits = bitmask << kWaiterBitsShift;
+        uint32_t clearBits = numWaiters == INT_MAX ? waiterBits : 0;
+        while (!mEfWordPtr->compare_exchange_weak(old, (old | bitmask) & ~clearBits)) {
+        }
+    } else {
+        /*
+         * Waiter tracking may be enabled on the word concurrently, in which
+         * case the waiter bits it sets are left for a later wake to clear.
+         */
+        old = std::atomic_fetch_or(mEfWordPtr, bitmask);
+    }
     /*
      * No need to call FUTEX_WAKE_BITSET if there were deferred wakes
-     * already available for all set bits from bitmask.
+     * already available for all set bits from bitmask, or if no thread
+     * registered as a waiter on them.
      */
-    if ((~old & bitmask) != 0) {
+    if ((~old & bitmask) != 0 && (!trackWaiters || (old & waiterBits) != 0)) {
         int ret = syscall(__NR_futex, mEfWordPtr, FUTEX_WAKE_BITSET,
-                          INT_MAX, NULL, NULL, bitmask);
+                          numWaiters, NULL, NULL, bitmask);
+        if (syscalled != nullptr) {
+            *syscalled = true;
+        }
         if (ret == -1) {
             status = -errno;
             ALOGE("Error in event flag wake attempt: %s\n", strerror(errno));
@@ -132,7 +198,8 @@ status_t EventFlag::wake(uint32_t bitmask) {
  * Wait for any of the bits in the bitmask to be set
  * and return which bits caused the return.
  */
-status_t EventFlag::waitHelper(uint32_t bitmask, uint32_t* efState, int64_t timeoutNanoSeconds) {
+status_t EventFlag::waitHelper(uint32_t bitmask, uint32_t* efState,
+                               const struct timespec* deadline) {
     /*
      * Return early if there are no set bits in bitmask.
      */
@@ -140,8 +207,18 @@ status_t EventFlag::waitHelper(uint32_t bitmask, uint32_t* efState, int64_t time
         return BAD_VALUE;
     }
 
+    bool trackWaiters = (mEfWordPtr->load(std::memory_order_relaxed) & kTrackWaitersBit) != 0;
+    if (trackWaiters && (bitmask & ~kEventBitsMask) != 0) {
+        return BAD_VALUE;
+    }
+
+    /*
+     * If waiter tracking is enabled on the word after it was checked, this
+     * thread counts among the waiters it assumes, see createEventFlag().
+     */
     status_t status = NO_ERROR;
-    uint32_t old = std::atomic_fetch_and(mEfWordPtr, ~bitmask);
+    uint32_t old = trackWaiters ? consumeOrRegisterWaiter(bitmask)
+                                : std::atomic_fetch_and(mEfWordPtr, ~bitmask);
     uint32_t setBits = old & bitmask;
     /*
      * If there was a deferred wake available, no need to call FUTEX_WAIT_BITSET.
@@ -151,24 +228,15 @@ status_t EventFlag::waitHelper(uint32_t bitmask, uint32_t* efState, int64_t time
         return status;
     }
 
-    uint32_t efWord = old & ~bitmask;
+    uint32_t efWord = trackWaiters ? old | (bitmask << kWaiterBitsShift) : old & ~bitmask;
     /*
      * The syscall will put the thread to sleep only
      * if the futex word still contains the expected
      * value i.e. efWord. If the futex word contents have
-     * changed, it fails with the error EAGAIN; If a timeout
-     * is specified and exceeded the syscall fails with ETIMEDOUT.
+     * changed, it fails with the error EAGAIN; If a deadline
+     * is specified and reached the syscall fails with ETIMEDOUT.
      */
-    int ret = 0;
-    if (timeoutNanoSeconds) {
-        struct timespec waitTimeAbsolute;
-        addNanosecondsToCurrentTime(timeoutNanoSeconds, &waitTimeAbsolute);
-
-        ret = syscall(__NR_futex, mEfWordPtr, FUTEX_WAIT_BITSET,
-                      efWord, &waitTimeAbsolute, NULL, bitmask);
-    } else {
-        ret = syscall(__NR_futex, mEfWordPtr, FUTEX_WAIT_BITSET, efWord, NULL, NULL, bitmask);
-    }
+    int ret = syscall(__NR_futex, mEfWordPtr, FUTEX_WAIT_BITSET, efWord, deadline, NULL, bitmask);
     if (ret == -1) {
         status = -errno;
         if (status != -EAGAIN && status != -ETIMEDOUT) {
@@ -187,6 +255,15 @@ status_t EventFlag::waitHelper(uint32_t bitmask, uint32_t* efState, int64_t time
     return status;
 }
 
+uint32_t EventFlag::consumeOrRegisterWaiter(uint32_t bitmask) {
+    uint32_t old = mEfWordPtr->load(std::memory_order_relaxed);
+    uint32_t desired;
+    do {
+        desired = (old & bitmask) != 0 ? old & ~bitmask : old | (bitmask << kWaiterBitsShift);
+    } while (!mEfWordPtr->compare_exchange_weak(old, desired));
+    return old;
+}
+
 /*
  * Wait for any of the bits in the bitmask to be set
  * and return which bits caused the return. If 'retry'
@@ -196,34 +273,57 @@ status_t EventFlag::wait(uint32_t bitmask,
                          uint32_t* efState,
                          int64_t timeoutNanoSeconds,
                          bool retry) {
-    if (!retry) {
-        return waitHelper(bitmask, efState, timeoutNanoSeconds);
+    if (timeoutNanoSeconds == 0) {
+        return waitUntil(bitmask, efState, 0 /* deadlineNanoSeconds */, retry);
     }
 
-    bool shouldTimeOut = timeoutNanoSeconds != 0;
-    int64_t prevTimeNs = shouldTimeOut ? android::elapsedRealtimeNano() : 0;
+    /*
+     * The timeout is converted to a deadline once, so that retries after a
+     * spurious wake-up do not need to account for the time spent so far.
+     */
+    struct timespec waitTimeAbsolute;
+    addNanosecondsToCurrentTime(timeoutNanoSeconds, &waitTimeAbsolute);
     status_t status;
-    while (true) {
-        if (shouldTimeOut) {
-            int64_t currentTimeNs = android::elapsedRealtimeNano();
-            /*
-             * Decrement TimeOutNanos to account for the time taken to complete the last
-             * iteration of the while loop.
-             */
-            timeoutNanoSeconds -= currentTimeNs - prevTimeNs;
-            prevTimeNs = currentTimeNs;
-            if (timeoutNanoSeconds <= 0) {
-                status = -ETIMEDOUT;
-                *efState = 0;
-                break;
-            }
-        }
+    do {
+        status = waitHelper(bitmask, efState, &waitTimeAbsolute);
+    } while (retry && (status == -EAGAIN || status == -EINTR));
+    return status;
+}
+
+/*
+ * Wait for any of the bits in the bitmask to be set until the absolute
+ * CLOCK_MONOTONIC deadline and return which bits caused the return. If
+ * 'retry' is true, wait again on a spurious wake-up.
+ */
+status_t EventFlag::waitUntil(uint32_t bitmask,
+                              uint32_t* efState,
+                              int64_t deadlineNanoSeconds,
+                              bool retry) {
+    static constexpr int64_t kNanosPerSecond = 1000000000;
 
-        status = waitHelper(bitmask, efState, timeoutNanoSeconds);
-        if ((status != -EAGAIN) && (status != -EINTR)) {
-            break;
+    /*
+     * A negative deadline cannot be converted to a valid timespec, and like
+     * any other deadline in the past it times out.
+     */
+    if (deadlineNanoSeconds < 0) {
+        if (efState != nullptr) {
+            *efState = 0;
         }
+        return TIMED_OUT;
+    }
+
+    struct timespec waitTimeAbsolute;
+    struct timespec* deadline = nullptr;
+    if (deadlineNanoSeconds != 0) {
+        waitTimeAbsolute.tv_sec = deadlineNanoSeconds / kNanosPerSecond;
+        waitTimeAbsolute.tv_nsec = deadlineNanoSeconds % kNanosPerSecond;
+        deadline = &waitTimeAbsolute;
     }
+
+    status_t status;
+    do {
+        status = waitHelper(bitmask, efState, deadline);
+    } while (retry && (status == -EAGAIN || status == -EINTR));
     return status;
 }
 
@@ -16,6 +16,12 @@
 
 #define LOG_TAG "FMQ"
 #include <android-base/logging.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace android {
 namespace hardware {
@@ -29,6 +35,84 @@ void logError(const std::string &message) {
     LOG(ERROR) << message;
 }
 
+/*
+ * Non-temporal stores are done 16 bytes at a time on a 16-byte aligned
+ * destination; the unaligned head and the tail are copied with memcpy().
+ */
+static constexpr size_t kStreamChunkSize = 16;
+
+/*
+ * The source is prefetched this many bytes ahead of the copy, one cache line
+ * at a time.
+ */
+static constexpr size_t kPrefetchDistance = 1024;
+static constexpr size_t kPrefetchStride = 64;
+
+void copyNonTemporal(void* dst, const void* src, size_t size) {
+#if defined(__SSE2__) || defined(__clang__)
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+
+    size_t head = (kStreamChunkSize - reinterpret_cast<uintptr_t>(d) % kStreamChunkSize) %
+            kStreamChunkSize;
+    if (head > size) {
+        head = size;
+    }
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+#if defined(__SSE2__)
+    for (; size >= kStreamChunkSize; size -= kStreamChunkSize) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d), chunk);
+        d += kStreamChunkSize;
+        s += kStreamChunkSize;
+    }
+    /*
+     * Streaming stores are weakly ordered. Make them visible before the write
+     * pointer is published.
+     */
+    _mm_sfence();
+#else
+    typedef uint64_t Chunk __attribute__((ext_vector_type(2)));
+    static_assert(sizeof(Chunk) == kStreamChunkSize, "Unexpected chunk size");
+    for (; size >= kStreamChunkSize; size -= kStreamChunkSize) {
+        Chunk chunk;
+        memcpy(&chunk, s, sizeof(chunk));
+        __builtin_nontemporal_store(chunk, reinterpret_cast<Chunk*>(d));
+        d += kStreamChunkSize;
+        s += kStreamChunkSize;
+    }
+#endif
+    memcpy(d, s, size);
+#else
+    memcpy(dst, src, size);
+#endif
+}
+
+void copyPrefetched(void* dst, const void* src, size_t size) {
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+
+    for (size_t offset = 0; offset < size && offset < kPrefetchDistance;
+         offset += kPrefetchStride) {
+        __builtin_prefetch(s + offset, 0 /* read */, 3 /* keep in all levels */);
+    }
+
+    while (size > 0) {
+        size_t chunk = size < kPrefetchStride ? size : kPrefetchStride;
+        if (size > kPrefetchDistance) {
+            __builtin_prefetch(s + kPrefetchDistance, 0 /* read */, 3 /* keep in all levels */);
+        }
+        memcpy(d, s, chunk);
+        d += chunk;
+        s += chunk;
+        size -= chunk;
+    }
+}
+
 }  // namespace details
 }  // namespace hardware
 }  // namespace android
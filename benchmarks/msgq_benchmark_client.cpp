@@ -20,6 +20,8 @@
 #include <utils/StrongPointer.h>
 #include <chrono>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include <android/hardware/tests/msgq/1.0/IBenchmarkMsgQ.h>
 #include <fmq/MessageQueue.h>
@@ -36,8 +38,15 @@ using std::cout;
 using std::endl;
 
 // libhidl
+using android::hardware::EventFlag;
+using android::hardware::kMQ32BitCounters;
+using android::hardware::kMQCopyDefault;
+using android::hardware::kMQCopyNonTemporal;
+using android::hardware::kMQCopyPrefetch;
 using android::hardware::kSynchronizedReadWrite;
+using android::hardware::MQCopyPolicy;
 using android::hardware::MQDescriptorSync;
+using android::hardware::MQWakePolicy;
 using android::hardware::MessageQueue;
 
 /*
@@ -61,6 +70,48 @@ enum PacketSizes {
     kPacketSize1024 = 1024
 };
 
+/*
+ * Size of the records written by the WriteBatch benchmarks and the number of
+ * records published per commit.
+ */
+static const size_t kBatchRecordSize = 16;
+static const size_t kBatchSizes[] = {8, 64, 512};
+
+/*
+ * Payload sizes and number of iterations of the copy policy benchmark, which
+ * runs on a local FMQ large enough for the largest payload.
+ */
+static const size_t kCopyPayloadSizes[] = {4 * 1024,   16 * 1024,  64 * 1024,      256 * 1024,
+                                           1024 * 1024, 4 * 1024 * 1024, 8 * 1024 * 1024};
+static const uint32_t kCopyIterations = 100;
+
+/*
+ * Size of the local FMQ of the prefetch benchmark, the prefetch distances it
+ * compares and its number of iterations.
+ */
+static const size_t kPrefetchQueueSize = 16 * 1024 * 1024;
+static const size_t kPrefetchDistances[] = {0, 512, 2048, 8192};
+static const uint32_t kPrefetchIterations = 10;
+
+/*
+ * Maximum spin times compared by the blocking ping pong benchmark, 0 meaning
+ * that the blocking calls wait on the EventFlag right away.
+ */
+static const int64_t kSpinWaitNanos[] = {0, 20 * 1000, 100 * 1000};
+
+/*
+ * Number of wake() calls timed by the EventFlag wake benchmark.
+ */
+static const uint32_t kWakeIterations = 100000;
+
+/*
+ * Number of kPacketSize64 packets streamed by the wake policy benchmark and
+ * the minimum numbers of packets per wake up it compares (0 meaning a wake
+ * up per write).
+ */
+static const uint32_t kCoalescePackets = 100000;
+static const size_t kCoalesceMinPackets[] = {0, 16, 64};
+
 class MQTestClient : public ::testing::Test {
 protected:
     virtual void TearDown() {
@@ -407,6 +458,61 @@ TEST_F(MQTestClient, BenchMarkMeasureWrite512Bytes) {
     delete[] data;
 }
 
+/*
+ * Measure the average time taken to write kBatchRecordSize byte records into
+ * the queue when each record is committed individually and when
+ * kBatchSizes[i] records are published with a single commit using a
+ * WriteBatch.
+ */
+TEST_F(MQTestClient, BenchMarkMeasureWriteBatch) {
+    uint8_t data[kBatchRecordSize] = {0};
+    uint32_t numRecords = kQueueSize / kBatchRecordSize;
+
+    uint64_t accumulatedTime = 0;
+    for (uint32_t i = 0; i < kNumIterations; i++) {
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                std::chrono::high_resolution_clock::now();
+        for (uint32_t j = 0; j < numRecords; j++) {
+            ASSERT_TRUE(mFmqOutbox->write(data, kBatchRecordSize));
+        }
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                std::chrono::high_resolution_clock::now();
+        accumulatedTime += (timeEnd - timeStart).count();
+
+        bool ret = service->requestRead(kQueueSize);
+        ASSERT_TRUE(ret);
+    }
+    accumulatedTime /= (numRecords * kNumIterations);
+    cout << "Average time to write a " << kBatchRecordSize
+         << "byte record with one commit per record: " << accumulatedTime << "ns" << endl;
+
+    for (size_t batchSize : kBatchSizes) {
+        uint32_t numBatches = numRecords / batchSize;
+        accumulatedTime = 0;
+        for (uint32_t i = 0; i < kNumIterations; i++) {
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                    std::chrono::high_resolution_clock::now();
+            for (uint32_t j = 0; j < numBatches; j++) {
+                MessageQueue<uint8_t, kSynchronizedReadWrite>::WriteBatch batch;
+                ASSERT_TRUE(mFmqOutbox->beginWriteBatch(batchSize * kBatchRecordSize, &batch));
+                for (size_t k = 0; k < batchSize; k++) {
+                    ASSERT_TRUE(batch.append(data, kBatchRecordSize));
+                }
+                ASSERT_TRUE(mFmqOutbox->commitWriteBatch(&batch));
+            }
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                    std::chrono::high_resolution_clock::now();
+            accumulatedTime += (timeEnd - timeStart).count();
+
+            bool ret = service->requestRead(kQueueSize);
+            ASSERT_TRUE(ret);
+        }
+        accumulatedTime /= (numBatches * batchSize * kNumIterations);
+        cout << "Average time to write a " << kBatchRecordSize << "byte record with "
+             << batchSize << " records per commit: " << accumulatedTime << "ns" << endl;
+    }
+}
+
 /*
  * Service continuously writes a packet of 64 bytes into the client's inbox
  * queue
@@ -432,3 +538,273 @@ TEST_F(MQTestClient, BenchMarkMeasureServiceWriteClientRead) {
     service->sendTimeData(clientRcvTimeArray);
     delete[] data;
 }
+
+/*
+ * Measure the average time to write and to read back payloads of 4KB to 8MB
+ * with each copy policy. The write and read policies are measured
+ * separately. This does not need the service.
+ */
+TEST(MQLocalCopy, BenchMarkMeasureCopyPolicies) {
+    const size_t maxPayloadSize = kCopyPayloadSizes[sizeof(kCopyPayloadSizes) /
+                                                    sizeof(kCopyPayloadSizes[0]) - 1];
+    MessageQueue<uint8_t, kSynchronizedReadWrite> fmq(maxPayloadSize);
+    ASSERT_TRUE(fmq.isValid());
+    std::vector<uint8_t> data(maxPayloadSize, 0xa5);
+    std::vector<uint8_t> readData(maxPayloadSize);
+
+    const struct {
+        MQCopyPolicy policy;
+        const char* name;
+    } policies[] = {{kMQCopyDefault, "memcpy"},
+                    {kMQCopyNonTemporal, "non-temporal"},
+                    {kMQCopyPrefetch, "prefetch"}};
+
+    for (size_t payloadSize : kCopyPayloadSizes) {
+        for (const auto& p : policies) {
+            fmq.setCopyPolicy(p.policy, p.policy);
+            int64_t writeTime = 0;
+            int64_t readTime = 0;
+            for (uint32_t i = 0; i < kCopyIterations; i++) {
+                std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                        std::chrono::high_resolution_clock::now();
+                ASSERT_TRUE(fmq.write(&data[0], payloadSize));
+                std::chrono::time_point<std::chrono::high_resolution_clock> timeMid =
+                        std::chrono::high_resolution_clock::now();
+                ASSERT_TRUE(fmq.read(&readData[0], payloadSize));
+                std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                        std::chrono::high_resolution_clock::now();
+                writeTime += static_cast<int64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(timeMid - timeStart)
+                                .count());
+                readTime += static_cast<int64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeMid)
+                                .count());
+            }
+            cout << "Average time to write/read " << payloadSize << " bytes with " << p.name
+                 << " copies: " << writeTime / kCopyIterations << "ns/"
+                 << readTime / kCopyIterations << "ns" << endl;
+        }
+    }
+}
+
+/*
+ * Measure the average time to read 64 bytes from a full 16MB FMQ with each
+ * prefetch distance. The FMQ is larger than the caches, so without
+ * prefetching the reads hit cold cache lines. This does not need the
+ * service.
+ */
+TEST(MQLocalPrefetch, BenchMarkMeasureRead64BytesPrefetch) {
+    MessageQueue<uint8_t, kSynchronizedReadWrite> fmq(kPrefetchQueueSize);
+    ASSERT_TRUE(fmq.isValid());
+    std::vector<uint8_t> data(kPrefetchQueueSize, 0xa5);
+    uint8_t readData[kPacketSize64];
+    uint32_t numLoops = kPrefetchQueueSize / kPacketSize64;
+
+    for (size_t distance : kPrefetchDistances) {
+        fmq.setPrefetchDistance(distance, 0 /* writeDistance */);
+        uint64_t accumulatedTime = 0;
+        for (uint32_t i = 0; i < kPrefetchIterations; i++) {
+            ASSERT_TRUE(fmq.write(&data[0], kPrefetchQueueSize));
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                    std::chrono::high_resolution_clock::now();
+            for (uint32_t j = 0; j < numLoops; j++) {
+                ASSERT_TRUE(fmq.read(readData, kPacketSize64));
+            }
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                    std::chrono::high_resolution_clock::now();
+            accumulatedTime += static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart)
+                            .count());
+        }
+        accumulatedTime /= (numLoops * kPrefetchIterations);
+        cout << "Average time to read " << kPacketSize64 << " bytes with a prefetch distance of "
+             << distance << " bytes: " << accumulatedTime << "ns" << endl;
+    }
+}
+
+/*
+ * Measure the average time to write and read back 64 bytes on a local FMQ
+ * with 64 bit and with 32 bit read and write pointer counters. The
+ * difference is expected in 32 bit processes, where 64 bit atomics are more
+ * expensive. This does not need the service.
+ */
+TEST(MQLocalCounterWidth, BenchMarkMeasureWriteRead64BytesCounterWidth) {
+    uint8_t data[kPacketSize64] = {};
+    uint32_t numLoops = kQueueSize / kPacketSize64;
+
+    for (bool counters32Bit : {false, true}) {
+        MessageQueue<uint8_t, kSynchronizedReadWrite> fmq(
+                kQueueSize, false /* configureEventFlagWord */,
+                counters32Bit ? kMQ32BitCounters : 0);
+        ASSERT_TRUE(fmq.isValid());
+        uint64_t accumulatedTime = 0;
+        for (uint32_t i = 0; i < kNumIterations; i++) {
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                    std::chrono::high_resolution_clock::now();
+            for (uint32_t j = 0; j < numLoops; j++) {
+                ASSERT_TRUE(fmq.write(data, kPacketSize64));
+                ASSERT_TRUE(fmq.read(data, kPacketSize64));
+            }
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                    std::chrono::high_resolution_clock::now();
+            accumulatedTime += static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart)
+                            .count());
+        }
+        accumulatedTime /= (numLoops * kNumIterations);
+        cout << "Average time to write and read " << kPacketSize64 << " bytes with "
+             << (counters32Bit ? 32 : 64) << " bit counters: " << accumulatedTime << "ns"
+             << endl;
+    }
+}
+
+/*
+ * Measure the round trip time of a 64 byte packet between two threads of this
+ * process using readBlocking()/writeBlocking() on two local FMQs, with and
+ * without spinning before waiting on the EventFlag.
+ */
+TEST(MQLocalSpinWait, BenchMarkMeasurePingPongBlocking) {
+    for (int64_t spinNanos : kSpinWaitNanos) {
+        MessageQueue<uint8_t, kSynchronizedReadWrite> outbox(kQueueSize,
+                                                             true /* configureEventFlagWord */);
+        MessageQueue<uint8_t, kSynchronizedReadWrite> inbox(kQueueSize,
+                                                            true /* configureEventFlagWord */);
+        ASSERT_TRUE(outbox.isValid());
+        ASSERT_TRUE(inbox.isValid());
+        outbox.setSpinWait(spinNanos);
+        inbox.setSpinWait(spinNanos);
+
+        std::thread echo([&]() {
+            uint8_t packet[kPacketSize64];
+            for (uint32_t i = 0; i < kNumIterations; i++) {
+                ASSERT_TRUE(outbox.readBlocking(packet, kPacketSize64));
+                ASSERT_TRUE(inbox.writeBlocking(packet, kPacketSize64));
+            }
+        });
+
+        uint8_t data[kPacketSize64] = {};
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                std::chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < kNumIterations; i++) {
+            ASSERT_TRUE(outbox.writeBlocking(data, kPacketSize64));
+            ASSERT_TRUE(inbox.readBlocking(data, kPacketSize64));
+        }
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                std::chrono::high_resolution_clock::now();
+        echo.join();
+
+        int64_t accumulatedTime = static_cast<int64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart)
+                        .count());
+        accumulatedTime /= kNumIterations;
+        cout << "Blocking round trip time for " << kPacketSize64 << " bytes with "
+             << spinNanos << "ns spin: " << accumulatedTime << "ns" << endl;
+    }
+}
+
+/*
+ * Measure the cost of EventFlag::wake() on a bit no thread waits for, with
+ * and without waiter tracking, both with no thread waiting on the flag word
+ * at all and with a thread parked on another bit of the same word. Every
+ * wake() is followed by a wait() which consumes the bit without blocking, so
+ * that the next wake() sets a clear bit again.
+ */
+TEST(MQLocalEventFlag, BenchMarkMeasureWake) {
+    static constexpr uint32_t kWakeBit = 1 << 0;
+    static constexpr uint32_t kParkBit = 1 << 1;
+
+    for (bool trackWaiters : {false, true}) {
+        for (bool parkedWaiter : {false, true}) {
+            std::atomic<uint32_t> efWord(0);
+            EventFlag* efGroup = nullptr;
+            ASSERT_EQ(android::NO_ERROR,
+                      EventFlag::createEventFlag(&efWord, &efGroup, trackWaiters));
+
+            std::thread waiter;
+            if (parkedWaiter) {
+                waiter = std::thread([efGroup]() {
+                    uint32_t efState = 0;
+                    efGroup->wait(kParkBit, &efState, 0 /* timeOutNanoSeconds */,
+                                  true /* retry */);
+                });
+                /*
+                 * Give the waiter time to park.
+                 */
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+
+            uint32_t efState = 0;
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                    std::chrono::high_resolution_clock::now();
+            for (uint32_t i = 0; i < kWakeIterations; i++) {
+                efGroup->wake(kWakeBit);
+                efGroup->wait(kWakeBit, &efState);
+            }
+            std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                    std::chrono::high_resolution_clock::now();
+
+            if (parkedWaiter) {
+                efGroup->wake(kParkBit);
+                waiter.join();
+            }
+            EventFlag::deleteEventFlag(&efGroup);
+
+            int64_t accumulatedTime = static_cast<int64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart)
+                            .count());
+            accumulatedTime /= kWakeIterations;
+            cout << "Average time to wake " << (parkedWaiter ? "with" : "without")
+                 << " a waiter parked on another bit, waiter tracking "
+                 << (trackWaiters ? "on" : "off") << ": " << accumulatedTime << "ns" << endl;
+        }
+    }
+}
+
+/*
+ * Stream kPacketSize64 packets through a local FMQ from a writer thread
+ * using writeBlocking() to a reader using readUpToBlocking(), with wake ups
+ * of the reader coalesced by count, and measure the time per packet and the
+ * number of packets the reader gets per read.
+ */
+TEST(MQLocalWakePolicy, BenchMarkMeasureCoalescedWrites) {
+    for (size_t minPackets : kCoalesceMinPackets) {
+        MessageQueue<uint8_t, kSynchronizedReadWrite> fmq(kQueueSize,
+                                                          true /* configureEventFlagWord */);
+        ASSERT_TRUE(fmq.isValid());
+        MQWakePolicy policy;
+        policy.minMessages = minPackets * kPacketSize64;
+        ASSERT_TRUE(fmq.setWakePolicy(policy));
+
+        uint32_t numReads = 0;
+        std::thread reader([&]() {
+            std::vector<uint8_t> data(kQueueSize);
+            size_t remaining = static_cast<size_t>(kCoalescePackets) * kPacketSize64;
+            while (remaining > 0) {
+                size_t read = fmq.readUpToBlocking(&data[0], std::min(remaining, data.size()),
+                                                   1000000000 /* timeOutNanos */);
+                ASSERT_NE(0u, read);
+                remaining -= read;
+                numReads++;
+            }
+        });
+
+        uint8_t data[kPacketSize64] = {};
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeStart =
+                std::chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < kCoalescePackets; i++) {
+            ASSERT_TRUE(fmq.writeBlocking(data, kPacketSize64));
+        }
+        fmq.flushNotifications();
+        reader.join();
+        std::chrono::time_point<std::chrono::high_resolution_clock> timeEnd =
+                std::chrono::high_resolution_clock::now();
+
+        int64_t accumulatedTime = static_cast<int64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart)
+                        .count());
+        accumulatedTime /= kCoalescePackets;
+        cout << "Average time to stream " << kPacketSize64 << " bytes waking the reader every "
+             << minPackets << " packets (0: every write): " << accumulatedTime << "ns, "
+             << kCoalescePackets / numReads << " packets per read" << endl;
+    }
+}
@@ -64,6 +64,48 @@ struct EventFlag {
     static status_t createEventFlag(std::atomic<uint32_t>* efWordPtr,
                                     EventFlag** ef);
 
+    /**
+     * Create an event flag object from the address of the flag word, and
+     * optionally enable tracking whether threads are waiting on the bits of
+     * the word.
+     *
+     * Waiter tracking is a mode of the flag word, recorded in it as
+     * kTrackWaitersBit, and every EventFlag object using the word follows
+     * it, whichever overload created the object. Once it is enabled, only
+     * the bits of kEventBitsMask can be waited on and woken. The rest of the
+     * word is reserved: a thread waiting on a bit sets the corresponding
+     * waiter bit (the event bit shifted left by kWaiterBitsShift) before
+     * sleeping, so that wake() and wakeOne() can skip the futex wake syscall
+     * when no waiter is parked on the requested bits. wake() clears the
+     * waiter bits of the bits it wakes up; wakeOne() leaves them set, since
+     * other waiters may remain. Enabling the mode sets all the waiter bits,
+     * because threads may already be waiting on the word. The mode stays on
+     * for the lifetime of the word. A process using an older libfmq does not
+     * register as a waiter and can miss wake-ups, so it must not wait on a
+     * word with waiter tracking.
+     *
+     * @param efWordPtr Pointer to the event flag word.
+     * @param ef Pointer to the address of the EventFlag object that gets created. Will be set to
+     * nullptr if unsuccesful.
+     * @param trackWaiters Whether to enable waiter tracking on the flag word.
+     * If false, the object still tracks the waiters if the word has the mode
+     * enabled.
+     *
+     * @return Returns a status_t error code. Likely error codes are
+     * NO_ERROR if the method is successful or BAD_VALUE if efAddr is a null
+     * pointer.
+     */
+    static status_t createEventFlag(std::atomic<uint32_t>* efWordPtr,
+                                    EventFlag** ef,
+                                    bool trackWaiters);
+
+    /*
+     * Layout of a flag word with waiter tracking.
+     */
+    static constexpr uint32_t kEventBitsMask = 0x00007FFF;
+    static constexpr uint32_t kWaiterBitsShift = 16;
+    static constexpr uint32_t kTrackWaitersBit = 0x80000000;
+
     /**
      * Delete an EventFlag object.
      *
@@ -85,6 +127,30 @@ struct EventFlag {
      */
     status_t wake(uint32_t bitmask);
 
+    /**
+     * Set the specified bits of the event flag word here and wake up at most
+     * one of the threads waiting on them. Useful when each of the waiting
+     * threads would consume what the notification is about.
+     * @param bitmask The bits to be set on the event flag word.
+     *
+     * @return Returns a status_t error code. Likely error codes are
+     * NO_ERROR if the method is successful or BAD_VALUE if the bit mask
+     * does not have any bits set.
+     */
+    status_t wakeOne(uint32_t bitmask);
+
+    /**
+     * Same as wake() and wakeOne(), also reporting whether the futex wake
+     * syscall was made. It is skipped when all the bits were already set,
+     * or, with waiter tracking, when no thread waits on them.
+     * @param bitmask The bits to be set on the event flag word.
+     * @param syscalled Set to whether the futex wake syscall was made.
+     *
+     * @return Same as wake() and wakeOne().
+     */
+    status_t wake(uint32_t bitmask, bool* syscalled);
+    status_t wakeOne(uint32_t bitmask, bool* syscalled);
+
     /**
      * Wait for any of the bits in the bit mask to be set.
      *
@@ -106,6 +172,28 @@ struct EventFlag {
                   uint32_t* efState,
                   int64_t timeOutNanoSeconds = 0,
                   bool retry = false);
+
+    /**
+     * Wait for any of the bits in the bit mask to be set until an absolute
+     * deadline. The deadline is handed to the futex syscall as is, so unlike
+     * wait(), retrying after a spurious wake does not read the clock.
+     *
+     * @param bitmask The bits to wait on.
+     * @param efState The event flag bits that caused the return from wake.
+     * @param deadlineNanoSeconds Absolute CLOCK_MONOTONIC time in nanoseconds,
+     * e.g. systemTime(SYSTEM_TIME_MONOTONIC) plus a timeout, at which the wait
+     * times out. Zero to wait without a deadline. A negative deadline
+     * returns TIMED_OUT right away, and one in the past returns TIMED_OUT
+     * without sleeping unless some of the bits are already set.
+     * @param retry If true, retry automatically for a spurious wake. If false,
+     * will return -EINTR or -EAGAIN for a spurious wake.
+     *
+     * @return Returns a status_t error code, see wait().
+     */
+    status_t waitUntil(uint32_t bitmask,
+                       uint32_t* efState,
+                       int64_t deadlineNanoSeconds,
+                       bool retry = false);
 private:
     bool mEfWordNeedsUnmapping = false;
     std::atomic<uint32_t>* mEfWordPtr = nullptr;
@@ -129,9 +217,24 @@ private:
     EventFlag(const EventFlag& other) = delete;
 
     /*
-     * Wait for any of the bits in the bit mask to be set.
+     * Wait for any of the bits in the bit mask to be set until the absolute
+     * CLOCK_MONOTONIC time 'deadline', or without a deadline if it is nullptr.
+     */
+    status_t waitHelper(uint32_t bitmask, uint32_t* efState, const struct timespec* deadline);
+
+    /*
+     * Set the bits of the bit mask and wake up at most 'numWaiters' threads.
+     * 'syscalled', if not nullptr, is set to whether the futex wake syscall
+     * was made.
+     */
+    status_t wakeHelper(uint32_t bitmask, int numWaiters, bool* syscalled);
+
+    /*
+     * Consume the bits of the bit mask which are set, or register the
+     * calling thread as a waiter on the bit mask if none is. Returns the
+     * value the flag word had before.
      */
-    status_t waitHelper(uint32_t bitmask, uint32_t* efState, int64_t timeOutNanoSeconds);
+    uint32_t consumeOrRegisterWaiter(uint32_t bitmask);
 
     /*
      * Utility method to unmap the event flag word.
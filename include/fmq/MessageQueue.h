@@ -17,14 +17,22 @@
 #ifndef HIDL_MQ_H
 #define HIDL_MQ_H
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cutils/ashmem.h>
+#include <fcntl.h>
 #include <fmq/EventFlag.h>
 #include <hidl/MQDescriptor.h>
+#include <linux/memfd.h>
+#include <mutex>
 #include <new>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <utils/Log.h>
 #include <utils/SystemClock.h>
+#include <utils/Timers.h>
+#include <vector>
 
 namespace android {
 namespace hardware {
@@ -32,8 +40,344 @@ namespace hardware {
 namespace details {
 void check(bool exp);
 void logError(const std::string &message);
+void copyNonTemporal(void* dst, const void* src, size_t size);
+void copyPrefetched(void* dst, const void* src, size_t size);
 }  // namespace details
 
+/**
+ * Options that can be OR'ed together and passed to the MessageQueue
+ * constructor which allocates the shared memory for an FMQ. The options are
+ * recorded in the flags of the DATAPTRPOS grantor so that they can be
+ * queried by every process which has the MQDescriptor.
+ */
+enum MQCreationFlags : uint32_t {
+    /*
+     * Round the capacity of the FMQ up to the next power of two. If sizeof(T)
+     * is a power of two as well, the size of the ring buffer in bytes is a
+     * power of two and ring buffer offsets are computed with a mask instead of
+     * an integer division.
+     */
+    kMQPowerOfTwoCapacity = 1 << 0,
+    /*
+     * Place the read pointer counter, the write pointer counter and the
+     * EventFlag word on separate 64 byte cache lines, followed by the ring
+     * buffer starting on a cache line boundary. This keeps the reader and the
+     * writer from contending for the same cache line. Since the layout is fully
+     * described by the grantor offsets, processes using a libfmq which does
+     * not know about this option still attach to the FMQ correctly.
+     */
+    kMQCacheLineIsolation = 1 << 1,
+    /*
+     * Same as kMQCacheLineIsolation, but with 128 byte cache lines.
+     */
+    kMQCacheLineIsolation128 = 1 << 2,
+    /*
+     * Map the ring buffer twice back-to-back in virtual memory, so that any
+     * range of messages is contiguous and MemTransaction objects never have a
+     * second MemRegion. The ring buffer starts on a page boundary and its
+     * capacity is rounded up so that its size is a multiple of the page size.
+     * Processes which cannot establish the mirrored mapping (or use a libfmq
+     * which does not know about this option) map the ring buffer once and
+     * see wrap arounds as usual.
+     */
+    kMQMirroredRing = 1 << 3,
+    /*
+     * Populate the page tables of the mappings of the ring buffer, the
+     * counters and the EventFlag word when they are mapped, so that the first
+     * access to each page does not take a page fault. This is a mapping
+     * option: it only affects the process which maps the FMQ, and it can also
+     * be passed to the MessageQueue constructor which takes an MQDescriptor.
+     */
+    kMQPrefault = 1 << 4,
+    /*
+     * Same as kMQPrefault, and lock the mappings into memory with mlock() so
+     * that they are never paged out. Failures to lock the mappings, e.g. due
+     * to RLIMIT_MEMLOCK, are logged and reported by isMemoryLocked() but do
+     * not make the FMQ invalid.
+     */
+    kMQLockMemory = 1 << 5,
+    /*
+     * Allocate the shared memory with memfd_create() instead of ashmem. This
+     * is also done without the flag when ashmem is not available. The size
+     * of the memfd is sealed, so that no process holding it can shrink it
+     * under the mappings of the others.
+     */
+    kMQMemfd = 1 << 6,
+    /*
+     * Same as kMQMemfd, with the memfd backed by 2 MB huge pages
+     * (MFD_HUGETLB). The shared memory is rounded up to a multiple of 2 MB
+     * and allocated when the FMQ is created, which fails if not enough huge
+     * pages are available. Not compatible with kMQMirroredRing, which then
+     * falls back to a regular mapping.
+     */
+    kMQHugePages = 1 << 7,
+    /*
+     * Use 32 bit read and write pointer counters instead of 64 bit ones, so
+     * that 32 bit processes access them with plain 32 bit atomic instructions.
+     * The counters keep their 8 byte grantors and occupy their first 4 bytes.
+     * Every process attaching to the FMQ picks the counter width up from the
+     * grantor flags.
+     *
+     * Both ends must be updated together: this is a hard requirement. A
+     * process with a libfmq which predates this option only validates the
+     * handle, the number of grantors and the item size of the descriptor, so
+     * it attaches to such an FMQ without an error, accesses the counters as
+     * 64 bit ones and corrupts the FMQ once they wrap around at 2^32 bytes.
+     * No descriptor layout makes that validation reject the FMQ, so only pass
+     * this option when every process attaching to the FMQ is known to have a
+     * libfmq which supports it.
+     *
+     * The counters wrap around at 2^32 bytes, so the capacity is rounded up to
+     * the next power of two (as with kMQPowerOfTwoCapacity) and the FMQ is
+     * invalid unless the ring buffer size is then a power of two, i.e. unless
+     * sizeof(T) is a power of two. An unsynchronized reader which falls behind
+     * by a multiple of 2^32 bytes does not detect the overflow. Not supported
+     * by the multi-producer flavors, whose slot sequence numbers are derived
+     * from the 64 bit counter values.
+     *
+     * Not enabled by default: MQLocalCounterWidth in the benchmarks measures
+     * no gain for 64 bit processes, and none has been measured yet for 32
+     * bit ones. Only pass it after the benchmark shows a gain on the target.
+     */
+    kMQ32BitCounters = 1 << 8,
+    /*
+     * Allocate a statistics grantor holding counters of the traffic through
+     * the FMQ, which all processes attached to it update and can query (see
+     * MessageQueue::getStats()). The writers and the readers update
+     * counters on separate cache lines, with relaxed atomic operations.
+     */
+    kMQStatistics = 1 << 9,
+    /*
+     * Track the threads waiting on the EventFlag word of the FMQ in the upper
+     * half of the word (see EventFlag::createEventFlag()), so that the
+     * blocking methods skip the futex wake syscall when no thread waits for
+     * their notification. Only the lower 15 bits of the word can then be used
+     * as notifications. The mode is recorded in the word itself, so that
+     * EventFlag objects created by the application on getEventFlagWord()
+     * follow it as well. All the processes using the word need a libfmq
+     * which knows about the option. Has no effect unless the FMQ has an
+     * EventFlag word.
+     */
+    kMQEventFlagWaiterTracking = 1 << 10,
+    /*
+     * Allocate a read threshold grantor, through which a reader blocked in
+     * readBlocking() or readUpToBlocking() publishes how many items it
+     * waits for. Writers then only wake up the readers once that many items
+     * are available, so that a blocked reader is woken up once per read
+     * instead of once per write. While no threshold is published, every
+     * write wakes the readers up as without this option, so readers which
+     * wait on the EventFlag word without publishing one are woken up as
+     * long as no other reader waits for more items. Not supported by the
+     * multi-producer and multi-consumer flavors.
+     */
+    kMQReadWakeThreshold = 1 << 11,
+};
+
+/**
+ * How the items are copied between the FMQ and the buffers of the
+ * application by MemTransaction::copyTo()/copyFrom() and by the read and
+ * write methods (see MessageQueue::setCopyPolicy()).
+ */
+enum MQCopyPolicy : uint32_t {
+    /*
+     * memcpy().
+     */
+    kMQCopyDefault = 0,
+    /*
+     * Write into the FMQ with non-temporal (streaming) stores, which bypass
+     * the cache of the writer. Meant for large writes of data which the
+     * writer does not access again, so that they do not evict its working
+     * set. Falls back to memcpy() on architectures without such stores.
+     */
+    kMQCopyNonTemporal = 1,
+    /*
+     * Prefetch the source ahead of the copy. Meant for large reads, so that
+     * the data written by the peer is brought into the cache of the reader
+     * while it is being copied.
+     */
+    kMQCopyPrefetch = 2,
+};
+
+/**
+ * Where the reader of a kUnsynchronizedWrite FMQ moves its read pointer
+ * counter when it detects that it was lapped by the writer (see
+ * MessageQueue::setOverflowReadPosition()), or when it attaches to the FMQ
+ * (see the MessageQueue constructor which takes an MQReadPosition).
+ */
+enum MQReadPosition : uint32_t {
+    /*
+     * To the write pointer counter: only the items written afterwards are
+     * read.
+     */
+    kMQReadPositionNewest = 0,
+    /*
+     * To the oldest item still held by the ring buffer, i.e. one ring buffer
+     * size behind the write pointer counter (or to the first item if fewer
+     * were written). A write in progress overwrites the oldest items first,
+     * in which case the next commitRead() detects another overflow.
+     */
+    kMQReadPositionOldest = 1,
+    /*
+     * A given number of items behind the write pointer counter, capped as for
+     * kMQReadPositionOldest. Leaves the writer some room before the reader is
+     * lapped again.
+     */
+    kMQReadPositionLag = 2,
+};
+
+/**
+ * Data lost by a reader of a kUnsynchronizedWrite FMQ because it was lapped
+ * by the writer (see MessageQueue::getReadOverflowStats()).
+ */
+struct MQReadOverflowStats {
+    /*
+     * Number of overflows detected, i.e. of reads which failed because the
+     * reader was lapped.
+     */
+    uint64_t overflowCount = 0;
+    /*
+     * Number of items skipped by the reader when it moved its read pointer
+     * counter past the overwritten data.
+     */
+    uint64_t messagesLost = 0;
+    /*
+     * Time of the last overflow detected, in the android::elapsedRealtimeNano()
+     * time base, or 0 if there was none.
+     */
+    int64_t lastOverflowTimeNs = 0;
+};
+
+/**
+ * Number of buckets of the histograms of blocking wait times in
+ * MQEndpointStats. Bucket i counts the waits which lasted [2^i, 2^(i+1))
+ * nanoseconds, except for the first one, which also counts those shorter
+ * than 1ns, and the last one, which counts all the longer ones.
+ */
+constexpr size_t kMQWaitTimeBuckets = 32;
+
+/**
+ * Statistics of one side (the writers or the readers) of an FMQ created with
+ * kMQStatistics.
+ */
+struct MQEndpointStats {
+    /*
+     * Number of items written or read, and their size in bytes.
+     */
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    /*
+     * Number of writes which failed or were cut short because the FMQ was
+     * full, or of reads because it was empty. A blocking call counts once,
+     * however many times it retries while spinning or waiting.
+     */
+    uint64_t unavailableEvents = 0;
+    /*
+     * Number of waits on the EventFlag by the blocking methods, and their
+     * duration (see kMQWaitTimeBuckets).
+     */
+    uint64_t blockingWaits = 0;
+    uint64_t waitTimeHistogram[kMQWaitTimeBuckets] = {};
+    /*
+     * Number of futex wake syscalls made to wake up the other side, or
+     * another writer/reader of a multi-producer/multi-consumer flavor. Wakes
+     * which EventFlag skips because the bits were already set, or nobody
+     * waits on them with kMQEventFlagWaiterTracking, are not counted.
+     */
+    uint64_t wakes = 0;
+};
+
+/**
+ * Statistics of an FMQ created with kMQStatistics.
+ */
+struct MQStats {
+    MQEndpointStats writer;
+    MQEndpointStats reader;
+};
+
+/**
+ * Policy deciding when the writes of a MessageQueue object which notify the
+ * readers (writeBlocking(), writeUpToBlocking() and commitWriteBatch()) wake
+ * them up (see MessageQueue::setWakePolicy()). While none of the enabled
+ * conditions holds, the wake up is deferred. With no condition enabled, every
+ * write wakes the readers up.
+ */
+struct MQWakePolicy {
+    /*
+     * Wake up once at least this many items were written since the last
+     * wake up. 0 to disable.
+     */
+    size_t minMessages = 0;
+    /*
+     * Wake up once the FMQ holds at least this many items. 0 to disable.
+     * Not supported by the kUnsynchronizedWrite flavor.
+     */
+    size_t highWatermark = 0;
+    /*
+     * Wake up once at least this many nanoseconds passed since the last wake
+     * up, so that the readers are woken up at most about once per interval
+     * under a steady stream of writes. 0 to disable.
+     */
+    int64_t minIntervalNanos = 0;
+    /*
+     * Time after which a deferred wake up is overdue. The next write
+     * performs an overdue wake up even if no condition holds. 0 to use
+     * minIntervalNanos, or 1 ms if minIntervalNanos is 0 as well. Must not
+     * be negative nor shorter than minIntervalNanos.
+     */
+    int64_t maxDelayNanos = 0;
+    /*
+     * Start a thread which performs a deferred wake up once it is overdue,
+     * even if the writer stops writing. See MessageQueue::setWakePolicy().
+     */
+    bool flushThread = false;
+};
+
+/**
+ * FMQ flavor which allows several writers (threads or processes) to write
+ * into the FMQ concurrently, with a single reader. Writers reserve space by
+ * advancing the write pointer counter with a compare-and-swap and publish the
+ * items they wrote through per-slot sequence numbers stored in an additional
+ * grantor, so that the reader never reads an item which is still being
+ * written. The reader uses the same API as for kSynchronizedReadWrite.
+ *
+ * MQFlavor is declared by libhidl, which only knows about
+ * kSynchronizedReadWrite and kUnsynchronizedWrite. An MQDescriptor of this
+ * flavor can be sent as an MQDescriptorSync and reconstructed on the
+ * receiving side from its grantors, a clone of its native handle and its
+ * quantum.
+ */
+constexpr MQFlavor kMultiProducerSingleConsumer = static_cast<MQFlavor>(0x04);
+
+/**
+ * FMQ flavor which allows a single writer to hand out items to several
+ * readers (threads or processes), each item being read by exactly one of
+ * them. The readers share the read pointer counter in the READPTRPOS grantor
+ * and claim items by advancing it with a compare-and-swap once they have
+ * copied the items out. Blocking writes only wake up a single blocked reader,
+ * which wakes up another one if items are left after its read.
+ *
+ * As for kMultiProducerSingleConsumer, an MQDescriptor of this flavor can be
+ * sent as an MQDescriptorSync and reconstructed on the receiving side.
+ */
+constexpr MQFlavor kSingleProducerMultiConsumer = static_cast<MQFlavor>(0x08);
+
+/**
+ * Bounded FMQ flavor which allows several writers and several readers
+ * (threads or processes), each item being read by exactly one reader. Every
+ * slot of the ring buffer has a sequence number, stored in an additional
+ * grantor, which tells whether the slot is free for a given writer or holds
+ * an item for a given reader. Writers reserve space by advancing the write
+ * pointer counter with a compare-and-swap once the sequence numbers show that
+ * the slots are free, and never load the read pointer counter. Readers claim
+ * items as for kSingleProducerMultiConsumer, hand the slots back to the
+ * writers through their sequence numbers, and never load the write pointer
+ * counter. The capacity must be at least two items.
+ *
+ * As for kMultiProducerSingleConsumer, an MQDescriptor of this flavor can be
+ * sent as an MQDescriptorSync and reconstructed on the receiving side.
+ */
+constexpr MQFlavor kMultiProducerMultiConsumer = static_cast<MQFlavor>(0x10);
+
 template <typename T, MQFlavor flavor>
 struct MessageQueue {
     typedef MQDescriptor<T, flavor> Descriptor;
@@ -42,8 +386,27 @@ struct MessageQueue {
      * @param Desc MQDescriptor describing the FMQ.
      * @param resetPointers bool indicating whether the read/write pointers
      * should be reset or not.
+     * @param mappingFlags Bit mask of the MQCreationFlags which are mapping
+     * options (kMQPrefault, kMQLockMemory), in addition to the ones the FMQ
+     * was created with.
+     */
+    MessageQueue(const Descriptor& Desc, bool resetPointers = true, uint32_t mappingFlags = 0);
+
+    /**
+     * Attach to an FMQ without resetting its read/write pointers, and for the
+     * kUnsynchronizedWrite flavor, start reading from 'attachPosition'
+     * instead of from the first item ever written. The other flavors share
+     * the read pointer counter between readers and ignore 'attachPosition'.
+     *
+     * @param Desc MQDescriptor describing the FMQ.
+     * @param attachPosition Where the read pointer counter of this reader
+     * starts, relative to the write pointer counter.
+     * @param attachLag Number of items behind the write pointer counter to
+     * start at with kMQReadPositionLag.
+     * @param mappingFlags Same as for the constructor above.
      */
-    MessageQueue(const Descriptor& Desc, bool resetPointers = true);
+    MessageQueue(const Descriptor& Desc, MQReadPosition attachPosition, size_t attachLag = 0,
+                 uint32_t mappingFlags = 0);
 
     ~MessageQueue();
 
@@ -54,8 +417,10 @@ struct MessageQueue {
      * @param numElementsInQueue Capacity of the MessageQueue in terms of T.
      * @param configureEventFlagWord Boolean that specifies if memory should
      * also be allocated and mapped for an EventFlag word.
+     * @param creationFlags Bit mask of MQCreationFlags.
      */
-    MessageQueue(size_t numElementsInQueue, bool configureEventFlagWord = false);
+    MessageQueue(size_t numElementsInQueue, bool configureEventFlagWord = false,
+                 uint32_t creationFlags = 0);
 
     /**
      * @return Number of items of type T that can be written into the FMQ
@@ -147,7 +512,10 @@ struct MessageQueue {
      * @param writeNotification The EventFlag bit mask to call wake on
      * a successful write. No wake is called if 'writeNotification' is zero.
      * @param timeOutNanos Number of nanoseconds after which the blocking
-     * write attempt is aborted.
+     * write attempt is aborted. The timeout is measured with CLOCK_MONOTONIC,
+     * so time spent in suspend does not count towards it (it used to be
+     * measured with CLOCK_BOOTTIME, which includes it). A negative timeout
+     * aborts the write after the first attempt, without waiting.
      * @param evFlag The EventFlag object to be used for blocking. If nullptr,
      * it is checked whether the FMQ owns an EventFlag object and that is used
      * for blocking instead.
@@ -160,6 +528,22 @@ struct MessageQueue {
 
     bool writeBlocking(const T* data, size_t count, int64_t timeOutNanos = 0);
 
+    /**
+     * Same as writeBlocking(), except that the write attempt is aborted at
+     * the absolute time 'deadlineNanos' rather than after a timeout. The
+     * deadline is a CLOCK_MONOTONIC time in nanoseconds, as returned by
+     * systemTime(SYSTEM_TIME_MONOTONIC), and is passed to the futex wait as
+     * is, so waking up does not require reading the clock. A zero deadline
+     * means no deadline. A deadline which already passed, including a
+     * negative one, makes the method return false after the first write
+     * attempt, without waiting.
+     */
+    bool writeBlockingUntil(const T* data, size_t count, uint32_t readNotification,
+                            uint32_t writeNotification, int64_t deadlineNanos,
+                            android::hardware::EventFlag* evFlag = nullptr);
+
+    bool writeBlockingUntil(const T* data, size_t count, int64_t deadlineNanos);
+
     /**
      * Read some data from the FMQ without blocking.
      *
@@ -197,7 +581,8 @@ struct MessageQueue {
      * @param writeNotification The EventFlag bit mask to call a wait on
      * if there is insufficient data in the FMQ to be read.
      * @param timeOutNanos Number of nanoseconds after which the blocking
-     * read attempt is aborted.
+     * read attempt is aborted. The timeout is measured with CLOCK_MONOTONIC
+     * like that of writeBlocking(), so time spent in suspend does not count.
      * @param evFlag The EventFlag object to be used for blocking.
      *
      * @return Whether the read was successful.
@@ -208,6 +593,90 @@ struct MessageQueue {
 
     bool readBlocking(T* data, size_t count, int64_t timeOutNanos = 0);
 
+    /**
+     * Same as readBlocking(), except that the read attempt is aborted at the
+     * absolute CLOCK_MONOTONIC time 'deadlineNanos', see writeBlockingUntil().
+     */
+    bool readBlockingUntil(T* data, size_t count, uint32_t readNotification,
+                           uint32_t writeNotification, int64_t deadlineNanos,
+                           android::hardware::EventFlag* evFlag = nullptr);
+
+    bool readBlockingUntil(T* data, size_t count, int64_t deadlineNanos);
+
+    /**
+     * Write as many of the 'maxMessages' items as currently fit into the FMQ
+     * without blocking, using a single transaction.
+     *
+     * @param data Pointer to the array of items of type T.
+     * @param maxMessages Number of items in array.
+     *
+     * @return Number of items written. Zero if no item could be written.
+     */
+    size_t writeUpTo(const T* data, size_t maxMessages);
+
+    /**
+     * Read as many items as are currently available in the FMQ, up to
+     * 'maxMessages', without blocking, using a single transaction.
+     *
+     * @param data Pointer to the array to which read data is to be written.
+     * @param maxMessages Maximum number of items to be read.
+     *
+     * @return Number of items read. Zero if no item could be read.
+     */
+    size_t readUpTo(T* data, size_t maxMessages);
+
+    /**
+     * Blocking version of writeUpTo(). If no item can be written,
+     * 'readNotification' is waited upon until at least one item can be
+     * written or the timeout expires. The parameters and the conditions under
+     * which the method returns without blocking are the same as for
+     * writeBlocking(), except that 'maxMessages' may exceed the FMQ size.
+     *
+     * @return Number of items written. Zero if no item could be written.
+     */
+    size_t writeUpToBlocking(const T* data, size_t maxMessages, uint32_t readNotification,
+                             uint32_t writeNotification, int64_t timeOutNanos = 0,
+                             android::hardware::EventFlag* evFlag = nullptr);
+
+    size_t writeUpToBlocking(const T* data, size_t maxMessages, int64_t timeOutNanos = 0);
+
+    /**
+     * Same as writeUpToBlocking(), except that the write attempt is aborted
+     * at the absolute CLOCK_MONOTONIC time 'deadlineNanos', see
+     * writeBlockingUntil().
+     */
+    size_t writeUpToBlockingUntil(const T* data, size_t maxMessages, uint32_t readNotification,
+                                  uint32_t writeNotification, int64_t deadlineNanos,
+                                  android::hardware::EventFlag* evFlag = nullptr);
+
+    size_t writeUpToBlockingUntil(const T* data, size_t maxMessages, int64_t deadlineNanos);
+
+    /**
+     * Blocking version of readUpTo(). If no item is available,
+     * 'writeNotification' is waited upon until at least one item can be read
+     * or the timeout expires. The parameters and the conditions under which
+     * the method returns without blocking are the same as for readBlocking(),
+     * except that 'maxMessages' may exceed the FMQ size.
+     *
+     * @return Number of items read. Zero if no item could be read.
+     */
+    size_t readUpToBlocking(T* data, size_t maxMessages, uint32_t readNotification,
+                            uint32_t writeNotification, int64_t timeOutNanos = 0,
+                            android::hardware::EventFlag* evFlag = nullptr);
+
+    size_t readUpToBlocking(T* data, size_t maxMessages, int64_t timeOutNanos = 0);
+
+    /**
+     * Same as readUpToBlocking(), except that the read attempt is aborted at
+     * the absolute CLOCK_MONOTONIC time 'deadlineNanos', see
+     * writeBlockingUntil().
+     */
+    size_t readUpToBlockingUntil(T* data, size_t maxMessages, uint32_t readNotification,
+                                 uint32_t writeNotification, int64_t deadlineNanos,
+                                 android::hardware::EventFlag* evFlag = nullptr);
+
+    size_t readUpToBlockingUntil(T* data, size_t maxMessages, int64_t deadlineNanos);
+
     /**
      * Get a pointer to the MQDescriptor object that describes this FMQ.
      *
@@ -221,9 +690,171 @@ struct MessageQueue {
      * @return Pointer to an EventFlag word, will return nullptr if not
      * configured. This method does not transfer ownership. The EventFlag
      * word will be unmapped by the MessageQueue destructor.
+     *
+     * If the FMQ was created with kMQEventFlagWaiterTracking, every
+     * EventFlag object created on the word tracks waiters, whichever
+     * createEventFlag() overload is used, and only the bits of
+     * EventFlag::kEventBitsMask can be used. A process waiting on the word
+     * through an older libfmq does not register as a waiter, and wakes which
+     * skip the futex syscall for lack of registered waiters can leave it
+     * blocked.
      */
     std::atomic<uint32_t>* getEventFlagWord() const { return mEvFlagWord; }
 
+    /**
+     * @return Whether the ring buffer is mapped twice back-to-back in this
+     * process. If true, every MemTransaction consists of a single MemRegion
+     * and messages can be accessed in place without handling wrap arounds.
+     */
+    bool isRingMirrored() const { return mRingMirrored; }
+
+    /**
+     * @return Whether kMQLockMemory was requested and all the mappings of the
+     * FMQ in this process were successfully locked into memory.
+     */
+    bool isMemoryLocked() const { return mMemoryLocked; }
+
+    /**
+     * Set how the read and write methods of this MessageQueue object copy the
+     * items. Both policies are kMQCopyDefault initially. They do not apply to
+     * write(const T*) and read(T*), which copy a single item inline.
+     *
+     * @param writePolicy Policy used to copy items into the FMQ.
+     * @param readPolicy Policy used to copy items out of the FMQ.
+     */
+    void setCopyPolicy(MQCopyPolicy writePolicy, MQCopyPolicy readPolicy) {
+        mWriteCopyPolicy = writePolicy;
+        mReadCopyPolicy = readPolicy;
+    }
+
+    /**
+     * Enable software prefetching of the ring buffer by this MessageQueue
+     * object. Once some items are made available for reading (by beginRead()
+     * and the read methods) or reserved for writing (by beginWrite() and the
+     * write methods), the cache lines up to the given number of bytes past
+     * them are prefetched, wrapping around to the start of the ring buffer.
+     * Prefetching is disabled initially.
+     *
+     * Prefetching for writing takes the cache lines away from the reader,
+     * hence it only helps if the reader is well behind the writer.
+     *
+     * @param readDistance Number of bytes prefetched ahead of the reads, 0 to
+     * disable prefetching for reading.
+     * @param writeDistance Number of bytes prefetched ahead of the writes, 0
+     * to disable prefetching for writing.
+     */
+    void setPrefetchDistance(size_t readDistance, size_t writeDistance) {
+        mReadPrefetchDistance = std::min(readDistance, mRingSize);
+        mWritePrefetchDistance = std::min(writeDistance, mRingSize);
+    }
+
+    /**
+     * Set where this reader of a kUnsynchronizedWrite FMQ moves its read
+     * pointer counter when it detects that it was lapped by the writer. The
+     * read which detects the overflow still fails, the following ones resume
+     * from the new position. Initially kMQReadPositionNewest.
+     *
+     * Only kMQReadPositionNewest is guaranteed to resume on a record boundary,
+     * so the other positions must not be used with beginReadRecord().
+     *
+     * @param position Where the read pointer counter is moved.
+     * @param lag Number of items behind the write pointer counter with
+     * kMQReadPositionLag.
+     */
+    void setOverflowReadPosition(MQReadPosition position, size_t lag = 0) {
+        mOverflowReadPosition = position;
+        mOverflowReadLag = lag;
+    }
+
+    /**
+     * Get the data lost by this reader of a kUnsynchronizedWrite FMQ since it
+     * was created or since the last resetReadOverflowStats() call. The
+     * statistics are updated by the read methods of this MessageQueue object
+     * and are not synchronized with them.
+     *
+     * @return The overflow statistics of this reader.
+     */
+    MQReadOverflowStats getReadOverflowStats() const { return mReadOverflowStats; }
+
+    /**
+     * Reset the statistics returned by getReadOverflowStats().
+     */
+    void resetReadOverflowStats() { mReadOverflowStats = MQReadOverflowStats(); }
+
+    /**
+     * Get a snapshot of the statistics shared by all the processes attached
+     * to an FMQ created with kMQStatistics. The counters are read one by one,
+     * so the snapshot is not atomic.
+     *
+     * @param stats The statistics.
+     *
+     * @return Whether the FMQ has statistics.
+     */
+    bool getStats(MQStats* stats) const;
+
+    /**
+     * Make the blocking read and write methods of this MessageQueue object
+     * spin on the FMQ before waiting on the EventFlag, so that data or space
+     * which becomes available shortly does not cost a futex wait and a
+     * context switch. The spin budget adapts to how long the recent transfers
+     * took to become possible: it moves towards twice that time when they
+     * became possible while spinning and is halved when they did not, within
+     * [min(1us, maxSpinNanos), maxSpinNanos]. Spinning only pays off when
+     * the peer runs on another CPU, so it is disabled initially. No gain has
+     * been measured yet (MQLocalSpinWait in the benchmarks shows none on a
+     * single CPU host), so only enable it after the benchmark shows one on
+     * the target device.
+     *
+     * @param maxSpinNanos Upper bound of the time spent spinning per blocking
+     * call, 0 to disable spinning.
+     */
+    void setSpinWait(int64_t maxSpinNanos) {
+        mMaxSpinNanos = std::max<int64_t>(maxSpinNanos, 0);
+        mSpinBudgetNanos.store(mMaxSpinNanos, std::memory_order_relaxed);
+    }
+
+    /**
+     * Coalesce the wake ups of the readers by the writes of this MessageQueue
+     * object according to 'policy', so that readers process larger batches
+     * and take fewer context switches. The policy is local to this object.
+     *
+     * A deferred wake up is performed by the first write meeting one of the
+     * conditions of the policy or finding the wake up overdue (see
+     * MQWakePolicy::maxDelayNanos), by a blocking write before it waits for
+     * space (so that the readers can free some), by flushNotifications() or
+     * by the destructor. A writer which stops writing thus leaves its last
+     * wake up deferred: either it calls flushNotifications() when it stops,
+     * or the readers block with a timeout, or the policy enables
+     * MQWakePolicy::flushThread. That option starts a thread of this object
+     * (stopped by the destructor or by a policy without it) which performs
+     * each deferred wake up once it is overdue, at the cost of the thread
+     * and of atomic read-modify-write updates of the writer wake statistics
+     * counter. The policy must not be changed concurrently with the writes
+     * of this object.
+     *
+     * The policy only applies to the writes which use the EventFlag object
+     * of the FMQ. Writes passing an EventFlag object of their own wake the
+     * readers up right away, since a deferred wake up could outlive that
+     * object.
+     *
+     * @param policy The wake policy.
+     *
+     * @return Whether the policy was applied. A highWatermark is rejected
+     * for the kUnsynchronizedWrite flavor, whose writer does not know the
+     * read pointer counters of the readers and thus how full the FMQ is, and
+     * so is a maxDelayNanos which is negative or shorter than
+     * minIntervalNanos. Any policy is rejected for an FMQ created with
+     * kMQReadWakeThreshold, whose readers decide when they are woken up, and
+     * the policy is rejected if the flush thread cannot be started. The
+     * previous policy is kept if the policy is rejected.
+     */
+    bool setWakePolicy(const MQWakePolicy& policy);
+
+    /**
+     * Perform the wake up deferred by the wake policy, if any.
+     */
+    void flushNotifications();
+
     /**
      * Describes a memory region in the FMQ.
      */
@@ -280,6 +911,7 @@ struct MessageQueue {
         MemTransaction& operator=(const MemTransaction &other) {
             first = other.first;
             second = other.second;
+            position = other.position;
             return *this;
         }
 
@@ -306,10 +938,12 @@ struct MessageQueue {
          * @param startIdx The slot number to begin the write from. If the
          * MemTransaction object is representing the memory region to read/write
          * N items of type T, the valid range of startIdx is between 0 and N-1;
+         * @param policy How the items are copied.
          *
          * @return Whether the write operation of size 'nMessages' succeeded.
          */
-        bool copyTo(const T* data, size_t startIdx, size_t nMessages = 1);
+        bool copyTo(const T* data, size_t startIdx, size_t nMessages = 1,
+                    MQCopyPolicy policy = kMQCopyDefault);
 
         /*
          * Helper method to read 'nMessages' items of type T from the memory
@@ -322,10 +956,12 @@ struct MessageQueue {
          * @param startIdx The slot number to begin the read from. If the
          * MemTransaction object is representing the memory region to read/write
          * N items of type T, the valid range of startIdx is between 0 and N-1.
+         * @param policy How the items are copied.
          *
          * @return Whether the read operation of size 'nMessages' succeeded.
          */
-        bool copyFrom(T* data, size_t startIdx, size_t nMessages = 1);
+        bool copyFrom(T* data, size_t startIdx, size_t nMessages = 1,
+                      MQCopyPolicy policy = kMQCopyDefault);
 
         /**
          * Returns a const reference to the first MemRegion in the
@@ -358,6 +994,15 @@ struct MessageQueue {
                                      T** secondBaseAddress);
         MemRegion first;
         MemRegion second;
+
+        friend struct MessageQueue;
+
+        /*
+         * Value of the read/write pointer counter at the start of the
+         * transaction. Used to commit transactions of the multi-producer and
+         * multi-consumer flavors.
+         */
+        uint64_t position = 0;
     };
 
     /**
@@ -378,17 +1023,39 @@ struct MessageQueue {
     /**
      * Commit a write of size 'nMessages'. To be only used after a call to beginWrite().
      *
+     * For kMultiProducerSingleConsumer, this commits the space reserved by the
+     * last beginWrite() call made through this MessageQueue object, and
+     * 'nMessages' must be equal to the number of items reserved. Threads which
+     * share a MessageQueue object must use commitWrite(const MemTransaction&)
+     * instead.
+     *
      * @param nMessages number of messages of type T to be written.
      *
      * @return Whether the write operation of size 'nMessages' succeeded.
      */
     bool commitWrite(size_t nMessages);
 
+    /**
+     * Commit the write described by 'memTx', which must have been obtained
+     * from beginWrite(). All the items described by 'memTx' are committed.
+     * Unlike commitWrite(size_t), this can be used concurrently by several
+     * threads sharing the MessageQueue object of a multi-producer flavor.
+     *
+     * @param memTx The MemTransaction object returned by beginWrite().
+     *
+     * @return Whether the write operation succeeded.
+     */
+    bool commitWrite(const MemTransaction& memTx);
+
     /**
      * Get a MemTransaction object to read 'nMessages' items of type T.
      * Once the read is performed using the information from MemTransaction,
      * the read operation is to be committed using a call to commitRead().
      *
+     * For kSingleProducerMultiConsumer, the items are only claimed by
+     * commitRead(), which fails if another reader claimed them first. In that
+     * case, whatever was read from the MemTransaction must be discarded.
+     *
      * @param nMessages Number of messages of type T.
      * @param pointer to MemTransaction struct that describes memory to read 'nMessages'
      * items of type T. If a read of size 'nMessages' is not possible, the base
@@ -404,322 +1071,2185 @@ struct MessageQueue {
      * For the unsynchronized flavor of FMQ, this method will return a failure
      * if a write overflow happened after beginRead() was invoked.
      *
+     * For kSingleProducerMultiConsumer, this commits the read started by the
+     * last beginRead() call made through this MessageQueue object, and fails
+     * if another reader claimed the items in the meantime. Threads which
+     * share a MessageQueue object must use commitRead(const MemTransaction&)
+     * instead.
+     *
      * @param nMessages number of messages of type T to be read.
      *
      * @return bool Whether the read operation of size 'nMessages' succeeded.
      */
     bool commitRead(size_t nMessages);
 
-private:
+    /**
+     * Commit the read described by 'memTx', which must have been obtained
+     * from beginRead(). All the items described by 'memTx' are committed.
+     * Unlike commitRead(size_t), this can be used concurrently by several
+     * threads sharing the MessageQueue object of a multi-consumer flavor.
+     *
+     * @param memTx The MemTransaction object returned by beginRead().
+     *
+     * @return bool Whether the read operation succeeded.
+     */
+    bool commitRead(const MemTransaction& memTx);
 
-    size_t availableToWriteBytes() const;
-    size_t availableToReadBytes() const;
+    /**
+     * Accumulates messages to be written into the FMQ and published to the
+     * reader(s) with a single commitWrite(). Space for the messages is
+     * reserved once by beginWriteBatch(). Not supported by the multi-producer
+     * flavors, since space reserved by them cannot be given back.
+     */
+    struct WriteBatch {
+        /**
+         * Append 'nMessages' items of type T to the batch. The items are
+         * copied into the FMQ right away, but are not visible to the reader(s)
+         * until commitWriteBatch() is called.
+         *
+         * @param data Pointer to the array of items of type T.
+         * @param nMessages Number of items in the array.
+         *
+         * @return Whether the items were appended. Fails without appending
+         * anything if the reserved space cannot accommodate 'nMessages' items.
+         */
+        bool append(const T* data, size_t nMessages = 1);
 
-    MessageQueue(const MessageQueue& other) = delete;
-    MessageQueue& operator=(const MessageQueue& other) = delete;
-    MessageQueue();
+        /**
+         * Append a record of 'length' bytes, framed as by writeRecord(), to
+         * the batch. If the record would wrap around the end of the ring
+         * buffer, padding is appended in front of it. Only supported for
+         * byte FMQs (sizeof(T) == 1).
+         *
+         * @param data Pointer to the payload of the record.
+         * @param length Length of the payload in bytes.
+         *
+         * @return Whether the record was appended. Fails without appending
+         * anything if the reserved space cannot accommodate the record and its
+         * padding.
+         */
+        bool appendRecord(const T* data, size_t length);
 
-    void* mapGrantorDescr(uint32_t grantorIdx);
-    void unmapGrantorDescr(void* address, uint32_t grantorIdx);
-    void initMemory(bool resetPointers);
+        /**
+         * Returns the number of items of type T appended to the batch.
+         */
+        inline size_t size() const { return count; }
 
-    enum DefaultEventNotification : uint32_t {
-        /*
-         * These are only used internally by the blockingRead()/blockingWrite()
-         * methods and hence once other bit combinations are not required.
+        /**
+         * Returns the number of items of type T that can still be appended.
          */
-        FMQ_NOT_FULL  = 0x01,
-        FMQ_NOT_EMPTY = 0x02
+        inline size_t available() const { return reserved - count; }
+
+    private:
+        friend struct MessageQueue;
+
+        MemTransaction tx;
+        /* Number of items of type T for which space was reserved. */
+        size_t reserved = 0;
+        /* Number of items of type T appended so far. */
+        size_t count = 0;
+        /* Index of the first item which wraps around the ring buffer. */
+        size_t wrapIdx = 0;
     };
 
-    std::unique_ptr<Descriptor> mDesc;
-    uint8_t* mRing = nullptr;
-    /*
-     * TODO(b/31550092): Change to 32 bit read and write pointer counters.
+    /**
+     * Reserve space for a batch of up to 'maxMessages' items of type T.
+     * The items are appended using WriteBatch::append() and the batch is
+     * published using commitWriteBatch().
+     *
+     * @param maxMessages Maximum number of items of type T in the batch.
+     * @param batch Pointer to the WriteBatch object to be initialized.
+     *
+     * @return Whether it is possible to write 'maxMessages' items of type T
+     * into the FMQ.
      */
-    std::atomic<uint64_t>* mReadPtr = nullptr;
-    std::atomic<uint64_t>* mWritePtr = nullptr;
+    bool beginWriteBatch(size_t maxMessages, WriteBatch* batch) const;
 
-    std::atomic<uint32_t>* mEvFlagWord = nullptr;
+    /**
+     * Publish all the items appended to 'batch' with a single commitWrite()
+     * and call wake at most once on 'writeNotification' (if non-zero).
+     *
+     * @param batch Pointer to the WriteBatch object set up by beginWriteBatch().
+     * @param writeNotification The EventFlag bit mask to call wake on after
+     * the batch is committed. No wake is called if 'writeNotification' is zero
+     * or if the batch is empty.
+     * @param evFlag The EventFlag object to call wake on. If nullptr, the
+     * EventFlag object owned by the FMQ is used.
+     *
+     * @return Whether the commit was successful.
+     */
+    bool commitWriteBatch(WriteBatch* batch, uint32_t writeNotification = 0,
+                          android::hardware::EventFlag* evFlag = nullptr);
 
-    /*
-     * This EventFlag object will be owned by the FMQ and will have the same
-     * lifetime.
+    /**
+     * Write a variable-length record into a byte FMQ (sizeof(T) == 1) without
+     * blocking. The record is framed with a header holding its length and is
+     * always contiguous in the ring buffer: if it would wrap around the end of
+     * the ring buffer, the rest of the ring buffer is skipped as padding, so
+     * that the reader can parse the record in place. Several records can be
+     * published with a single commit using WriteBatch::appendRecord().
+     *
+     * Records are not supported by the multi-producer and multi-consumer
+     * flavors. A record, including its header, must fit into the ring buffer
+     * from offset 0, i.e. 'length' may not exceed the FMQ size minus 4 bytes.
+     * If the record and the padding in front of it do not fit into the free
+     * space but the padding does, the padding is committed on its own and the
+     * record is written at the start of the ring buffer once enough space is
+     * free, so that the writer never gets stuck on the padding.
+     *
+     * @param data Pointer to the payload of the record.
+     * @param length Length of the payload in bytes.
+     *
+     * @return Whether the record was written.
      */
-    android::hardware::EventFlag* mEventFlag = nullptr;
-};
+    bool writeRecord(const T* data, size_t length);
 
-template <typename T, MQFlavor flavor>
-T* MessageQueue<T, flavor>::MemTransaction::getSlot(size_t idx) {
-    size_t firstRegionLength = first.getLength();
-    size_t secondRegionLength = second.getLength();
+    /**
+     * Get the payload of the next record written with writeRecord() or
+     * WriteBatch::appendRecord(). The payload is contiguous and can be parsed
+     * in place until commitReadRecord() is called. Padding committed by the
+     * writer on its own is consumed right away.
+     *
+     * @param record Pointer to the MemRegion to be set to the payload of the
+     * record.
+     *
+     * @return Whether a complete record was available.
+     */
+    bool beginReadRecord(MemRegion* record);
+
+    /**
+     * Commit the read of the record obtained by the last beginReadRecord()
+     * call, along with the padding and header in front of it.
+     *
+     * @return Whether the read was committed. For the unsynchronized flavor
+     * of FMQ, this fails if the record was overwritten in the meantime, in
+     * which case its payload must be discarded.
+     */
+    bool commitReadRecord();
+
+private:
+
+    size_t availableToWriteBytes() const;
+    size_t availableToReadBytes() const;
+
+    /*
+     * Implementation of beginWrite(), which does not record the reservation
+     * for commitWrite(size_t).
+     */
+    bool reserveWrite(size_t nMessages, MemTransaction* memTx) const;
+
+    /*
+     * Implementation of beginRead(), which does not record the read position
+     * for commitRead(size_t).
+     */
+    bool prepareRead(size_t nMessages, MemTransaction* memTx) const;
+
+    /*
+     * Reserve space for 'nMessages' items, or check that 'nMessages' items
+     * can be read, and return their write or read pointer counter value in
+     * 'position'. Used by reserveWrite() and prepareRead(), and directly by
+     * the single item write() and read(), which always access one contiguous
+     * slot and hence do not need a MemTransaction.
+     */
+    bool reserveWritePosition(size_t nMessages, uint64_t* position) const;
+    bool prepareReadPosition(size_t nMessages, uint64_t* position) const;
+
+    /*
+     * Returns the MemTransaction for the 'nMessages' items starting at the
+     * read/write pointer counter value 'position'.
+     */
+    MemTransaction getMemTransaction(uint64_t position, size_t nMessages) const;
+
+    /*
+     * Prefetch the cache lines of the ring buffer which enter the prefetch
+     * window of 'distance' bytes once the 'nBytes' bytes at the read/write
+     * pointer counter value 'position' are accessed. Successive accesses
+     * hence prefetch each cache line once.
+     */
+    void prefetchRing(uint64_t position, size_t nBytes, size_t distance, bool forWrite) const;
+
+    /*
+     * Claim 'nMessages' items starting at the read pointer counter value
+     * 'position'. Only used by the multi-consumer flavors. Returns false if
+     * another reader claimed them first. With kRecycledSlots, the slots of
+     * the claimed items are then handed back to the writers.
+     */
+    bool claimRead(uint64_t position, size_t nMessages);
+
+    /*
+     * Set the sequence numbers of the slots of the 'nMessages' items starting
+     * at the read/write pointer counter value 'position' to the index of each
+     * item plus 'seqOffset' (see mSlotSeq). Only used by the multi-producer
+     * flavors.
+     */
+    void storeSlotSeqs(uint64_t position, size_t nMessages, uint64_t seqOffset);
+
+    /*
+     * Returns how many of the 'nMessages' items starting at the read/write
+     * pointer counter value 'position' have a slot sequence number equal to
+     * their index plus 'seqOffset', counting from the first one up to the
+     * first mismatch. Only used by the multi-producer flavors.
+     */
+    size_t countSlotSeqs(uint64_t position, size_t nMessages, uint64_t seqOffset) const;
+
+    /*
+     * Copy a record of 'length' bytes, preceded by 'padding' bytes, into
+     * 'memTx' starting at 'startIdx'. The padding starts with a skip marker if
+     * it is large enough to hold one.
+     */
+    static bool copyRecord(MemTransaction* memTx, size_t startIdx, size_t padding,
+                           const T* data, size_t length);
+
+    /*
+     * Copy 'size' bytes according to 'policy'.
+     */
+    static void copyBytes(void* dst, const void* src, size_t size, MQCopyPolicy policy);
+
+    /*
+     * Copy 'nMessages' items according to 'policy'. Small counts of items are
+     * copied with a fixed size memcpy(), which the compiler inlines.
+     */
+    static void copyItems(T* dst, const T* src, size_t nMessages, MQCopyPolicy policy);
+
+    /*
+     * Common implementation of the blocking read and write methods.
+     * 'transfer' performs a non-blocking read or write and returns the number
+     * of items of type T transferred, which it only does once at least
+     * 'minMessages' items can be transferred. It is retried every time
+     * 'waitNotification' is woken, until it transfers at least one item or
+     * the absolute CLOCK_MONOTONIC time 'deadlineNanos' (if non-zero) is
+     * reached. Upon success, wake is called on 'wakeNotification' (if
+     * non-zero).
+     */
+    template <typename Transfer>
+    size_t transferBlocking(Transfer transfer, bool isWrite, size_t minMessages,
+                            uint32_t waitNotification, uint32_t wakeNotification,
+                            int64_t deadlineNanos, android::hardware::EventFlag* evFlag);
+
+    /*
+     * Convert a timeout of the blocking methods to the deadline expected by
+     * transferBlocking(), reading the clock only if there is a timeout.
+     */
+    static int64_t deadlineFromTimeout(int64_t timeOutNanos) {
+        return timeOutNanos != 0 ? systemTime(SYSTEM_TIME_MONOTONIC) + timeOutNanos : 0;
+    }
+
+    /*
+     * Retry 'transfer' until it transfers at least one item, for up to the
+     * current spin budget (and at most until 'deadlineNanos' if it is not 0),
+     * and adapt the spin budget. Returns the number of items transferred.
+     */
+    template <typename Transfer>
+    size_t spinTransfer(Transfer transfer, int64_t deadlineNanos);
+
+    /*
+     * Hint to the CPU that the calling thread is spinning.
+     */
+    static inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield" ::: "memory");
+#endif
+    }
+
+    /*
+     * Wake up the threads blocked in transferBlocking() after a successful
+     * transfer. If the peers of this endpoint compete for the items (or the
+     * space) that was transferred, only one of them is woken up. If the
+     * threads on this side compete with each other and another transfer is
+     * possible, one more of them is woken up, so that each item leads to a
+     * single wake up.
+     */
+    void wakeAfterTransfer(bool isWrite, size_t nMessages, uint32_t waitNotification,
+                           uint32_t wakeNotification, android::hardware::EventFlag* evFlag);
+
+    /*
+     * Wake up the readers on 'writeNotification' after 'nMessages' items were
+     * written, or defer the wake up according to the wake policy.
+     */
+    void wakeReaders(size_t nMessages, uint32_t writeNotification,
+                     android::hardware::EventFlag* evFlag);
+
+    /*
+     * Start and stop the flush thread of MQWakePolicy::flushThread.
+     * scheduleFlush() makes it perform the deferred wake up at
+     * 'deadlineNanos' (CLOCK_MONOTONIC). runFlushThread() is the body of the
+     * thread, which runs until stopFlushThread() is called.
+     */
+    bool startFlushThread();
+    void stopFlushThread();
+    void scheduleFlush(int64_t deadlineNanos);
+    void runFlushThread();
+
+    /*
+     * Publish that this reader waits for 'nMessages' items in the read
+     * threshold grantor, unless another reader waits for fewer bytes to be
+     * written. A threshold left behind by a reader which did not need to
+     * wait, or timed out, costs a single spurious wake up once reached.
+     */
+    void publishReadThreshold(size_t nMessages);
+
+    /*
+     * Whether the write pointer counter reached the published read
+     * threshold, or no reader published one. Consumes a reached threshold.
+     */
+    bool consumeReadThreshold();
+
+    MessageQueue(const MessageQueue& other) = delete;
+    MessageQueue& operator=(const MessageQueue& other) = delete;
+    MessageQueue();
+
+    /*
+     * Map each distinct fd of the native handle once, covering all the
+     * grantors which reference it. If the ring buffer is mapped mirrored, it
+     * is left out, and the grantors on its fd in front of it and after it get
+     * a mapping each.
+     */
+    void mapGrantors(bool skipRing);
+    void unmapGrantors();
+
+    /*
+     * Returns the address of the grantor in the mappings made by
+     * mapGrantors(). If 'mirrored' is true, the grantor is instead mapped
+     * twice back-to-back on its own. This requires the grantor offset and
+     * extent to be multiples of the page size, and the mapping is to be
+     * released with unmapGrantorDescr().
+     */
+    void* mapGrantorDescr(uint32_t grantorIdx, bool mirrored = false);
+    void unmapGrantorDescr(void* address, uint32_t grantorIdx);
+
+    /*
+     * Lock a mapping made by mapGrantorDescr() into memory if kMQLockMemory
+     * was requested. Clears mMemoryLocked upon failure.
+     */
+    void lockMapping(void* address, size_t length);
+    void initMemory(bool resetPointers, uint32_t mappingFlags);
+
+    /*
+     * Returns the read pointer counter value 'position' (with 'lag' items for
+     * kMQReadPositionLag) corresponds to, given the write pointer counter
+     * value 'writePtr'.
+     */
+    uint64_t getReadPosition(MQReadPosition position, size_t lag, uint64_t writePtr) const;
+
+    /*
+     * Handle the overflow detected by the reader of a kUnsynchronizedWrite
+     * FMQ at the read pointer counter value 'readPtr' given the write pointer
+     * counter value 'writePtr': move the read pointer counter as selected by
+     * setOverflowReadPosition() and account for the items skipped.
+     */
+    void handleReadOverflow(uint64_t readPtr, uint64_t writePtr) const;
+
+    /*
+     * Update the statistics grantor, if any, on behalf of the writers
+     * ('isWrite') or the readers: for a transfer of 'nMessages' items, for a
+     * transfer which failed for lack of space or data, for a blocking wait
+     * which lasted 'waitTimeNs', and for an EventFlag wake which made the
+     * futex wake syscall.
+     */
+    void statsTransfer(bool isWrite, size_t nMessages) const;
+    void statsUnavailable(bool isWrite) const;
+    void statsWait(bool isWrite, int64_t waitTimeNs) const;
+    void statsWake(bool isWrite) const;
+
+    /*
+     * Set while transferBlocking() retries the transfer of the calling
+     * thread, whose first attempt already counted the unavailable event, so
+     * that statsUnavailable() does not count the retries.
+     */
+    static thread_local bool sRetryingTransfer;
+
+    /*
+     * Set 'bitmask' on 'evFlag' and wake up the threads waiting on it, or at
+     * most one of them if 'wakeOne', on behalf of the writers ('isWrite') or
+     * the readers, accounting for the wake in the statistics.
+     */
+    void wakeEventFlag(android::hardware::EventFlag* evFlag, uint32_t bitmask, bool wakeOne,
+                       bool isWrite) const;
+    static void addStat(std::atomic<uint64_t>& counter, uint64_t value, bool exclusive);
+
+    /*
+     * Returns the grantors for an FMQ created with MQCreationFlags that
+     * require libfmq to lay out the shared memory instead of the Descriptor.
+     */
+    static std::vector<android::hardware::GrantorDescriptor> getGrantors(
+            size_t queueSizeBytes, bool configureEventFlagWord, uint32_t creationFlags);
+
+    /*
+     * Returns an fd for 'size' bytes of shared memory, allocated with the
+     * backend selected by 'creationFlags' (ashmem, kMQMemfd or kMQHugePages),
+     * or -1 upon failure. A memfd is used when ashmem is not available.
+     */
+    static int createSharedMemory(size_t size, uint32_t creationFlags);
+
+    /*
+     * Returns the offset into the ring buffer of the read/write pointer
+     * counter 'ptr'.
+     */
+    inline size_t getRingOffset(uint64_t ptr) const {
+        return mRingMask != 0 ? static_cast<size_t>(ptr & mRingMask)
+                              : static_cast<size_t>(ptr % mRingSize);
+    }
+
+    /*
+     * Returns the number of bytes from the read/write pointer counter value
+     * 'from' to 'to'. With 32 bit counters, the values loaded from the
+     * counters are only meaningful modulo 2^32.
+     */
+    inline uint64_t getCounterDistance(uint64_t to, uint64_t from) const {
+        return m32BitCounters ? static_cast<uint32_t>(to - from) : to - from;
+    }
+
+    /*
+     * Read or write pointer counter, 64 bits wide or 32 bits wide with
+     * kMQ32BitCounters. Its value is handled as a uint64_t either way; a 32
+     * bit counter stores the low 32 bits of the values and loads them
+     * zero-extended. Like a pointer, a const PointerCounter still allows the
+     * counter it refers to to be modified.
+     */
+    class PointerCounter {
+    public:
+        void init(void* address, bool is32Bit) {
+            mAddress = address;
+            mIs32Bit = is32Bit;
+        }
+
+        /*
+         * Allocate a counter private to this process. Used for the read
+         * pointer counter of the unsynchronized write flavor.
+         */
+        void allocate(bool is32Bit) {
+            if (is32Bit) {
+                init(new (std::nothrow) std::atomic<uint32_t>, true);
+            } else {
+                init(new (std::nothrow) std::atomic<uint64_t>, false);
+            }
+        }
+
+        /*
+         * Free a counter allocated by allocate().
+         */
+        void release() {
+            if (mIs32Bit) {
+                delete counter32();
+            } else {
+                delete counter64();
+            }
+            mAddress = nullptr;
+        }
+
+        bool isValid() const { return mAddress != nullptr; }
+
+        uint64_t load(std::memory_order order) const {
+            return mIs32Bit ? counter32()->load(order) : counter64()->load(order);
+        }
+
+        void store(uint64_t value, std::memory_order order) const {
+            if (mIs32Bit) {
+                counter32()->store(static_cast<uint32_t>(value), order);
+            } else {
+                counter64()->store(value, order);
+            }
+        }
+
+        bool compare_exchange_weak(uint64_t& expected, uint64_t desired,
+                                   std::memory_order order) const {
+            if (!mIs32Bit) {
+                return counter64()->compare_exchange_weak(expected, desired, order);
+            }
+            uint32_t expected32 = static_cast<uint32_t>(expected);
+            bool exchanged = counter32()->compare_exchange_weak(
+                    expected32, static_cast<uint32_t>(desired), order);
+            expected = expected32;
+            return exchanged;
+        }
+
+        bool compare_exchange_strong(uint64_t& expected, uint64_t desired,
+                                     std::memory_order success,
+                                     std::memory_order failure) const {
+            if (!mIs32Bit) {
+                return counter64()->compare_exchange_strong(expected, desired, success, failure);
+            }
+            uint32_t expected32 = static_cast<uint32_t>(expected);
+            bool exchanged = counter32()->compare_exchange_strong(
+                    expected32, static_cast<uint32_t>(desired), success, failure);
+            expected = expected32;
+            return exchanged;
+        }
+
+    private:
+        std::atomic<uint32_t>* counter32() const {
+            return static_cast<std::atomic<uint32_t>*>(mAddress);
+        }
+        std::atomic<uint64_t>* counter64() const {
+            return static_cast<std::atomic<uint64_t>*>(mAddress);
+        }
+
+        void* mAddress = nullptr;
+        bool mIs32Bit = false;
+    };
+
+    /*
+     * Grantors appended by libfmq after the ones declared by
+     * Descriptor::GrantorType. If any of them is present, the EVFLAGWORDPOS
+     * grantor is present as well, with a zero extent if no EventFlag word was
+     * configured.
+     */
+    enum ExtendedGrantorType : uint32_t {
+        SLOTSEQPOS = Descriptor::EVFLAGWORDPOS + 1,
+        STATSPOS = Descriptor::EVFLAGWORDPOS + 2,
+        READTHRESHOLDPOS = Descriptor::EVFLAGWORDPOS + 3,
+    };
+
+    /*
+     * Layout of the statistics grantor (see MQEndpointStats). The counters
+     * of each side start on their own cache line.
+     */
+    struct alignas(64) SharedEndpointStats {
+        std::atomic<uint64_t> messages;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> unavailableEvents;
+        std::atomic<uint64_t> blockingWaits;
+        std::atomic<uint64_t> waitTimeHistogram[kMQWaitTimeBuckets];
+        std::atomic<uint64_t> wakes;
+    };
+    struct SharedStats {
+        SharedEndpointStats writer;
+        SharedEndpointStats reader;
+    };
+
+    /*
+     * Whether a single thread updates the statistics of the writers or of
+     * the readers. Its counters are then updated with a relaxed load and
+     * store instead of a read-modify-write operation.
+     */
+    static constexpr bool kExclusiveWriterStats = flavor == kSynchronizedReadWrite ||
+            flavor == kUnsynchronizedWrite || flavor == kSingleProducerMultiConsumer;
+    static constexpr bool kExclusiveReaderStats =
+            flavor == kSynchronizedReadWrite || flavor == kMultiProducerSingleConsumer;
+
+    /*
+     * Whether the writer must never overwrite items which were not read yet.
+     */
+    static constexpr bool kSynchronizedWrite = flavor != kUnsynchronizedWrite;
+
+    /*
+     * Whether several writers may write into the FMQ concurrently.
+     */
+    static constexpr bool kMultiProducer =
+            flavor == kMultiProducerSingleConsumer || flavor == kMultiProducerMultiConsumer;
+
+    /*
+     * Whether several readers may read from the FMQ concurrently, each item
+     * being read by exactly one of them.
+     */
+    static constexpr bool kMultiConsumer =
+            flavor == kSingleProducerMultiConsumer || flavor == kMultiProducerMultiConsumer;
+
+    /*
+     * Whether readers hand slots back to the writers through the slot
+     * sequence numbers. Writers then find free slots without loading the read
+     * pointer counter and readers find items without loading the write
+     * pointer counter.
+     */
+    static constexpr bool kRecycledSlots = flavor == kMultiProducerMultiConsumer;
+
+    /*
+     * Size of the huge pages used with kMQHugePages.
+     */
+    static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+    /*
+     * Items up to this size are copied with an inlined fixed size memcpy()
+     * when a few of them are copied by copyItems().
+     */
+    static constexpr size_t kInlineCopyMaxItemSize = 64;
+
+    /*
+     * Granularity of the software prefetching of the ring buffer.
+     */
+    static constexpr size_t kPrefetchLineSize = 64;
+
+    /*
+     * While spinning, the FMQ is polled every kSpinRelaxCount CPU relax
+     * hints. The adaptive spin budget does not go below kMinSpinNanos.
+     */
+    static constexpr int kSpinRelaxCount = 16;
+    static constexpr int64_t kMinSpinNanos = 1000;
+
+    /*
+     * Records are framed with a header holding the length of their payload.
+     * A header holding kRecordSkip instead marks the rest of the ring buffer
+     * as padding. The reader also skips the rest of the ring buffer if it is
+     * too small to hold a header.
+     */
+    static constexpr size_t kRecordHeaderSize = sizeof(uint32_t);
+    static constexpr uint32_t kRecordSkip = UINT32_MAX;
+
+    enum DefaultEventNotification : uint32_t {
+        /*
+         * These are only used internally by the blockingRead()/blockingWrite()
+         * methods and hence once other bit combinations are not required.
+         */
+        FMQ_NOT_FULL  = 0x01,
+        FMQ_NOT_EMPTY = 0x02
+    };
+
+    std::unique_ptr<Descriptor> mDesc;
+    uint8_t* mRing = nullptr;
+
+    /*
+     * Geometry of the ring buffer. It is cached here when the FMQ is
+     * initialized so that the read/write paths do not have to go through
+     * mDesc. mRingMask is zero unless mRingSize is a power of two.
+     */
+    size_t mRingSize = 0;
+    size_t mRingMask = 0;
+    size_t mQuantumCount = 0;
+    bool mRingMirrored = false;
+
+    MQCopyPolicy mWriteCopyPolicy = kMQCopyDefault;
+    MQCopyPolicy mReadCopyPolicy = kMQCopyDefault;
+
+    /*
+     * Number of bytes prefetched ahead of the reads and writes, see
+     * setPrefetchDistance().
+     */
+    size_t mReadPrefetchDistance = 0;
+    size_t mWritePrefetchDistance = 0;
+
+    /*
+     * Where the read pointer counter is moved upon an overflow of the
+     * kUnsynchronizedWrite flavor, see setOverflowReadPosition().
+     */
+    MQReadPosition mOverflowReadPosition = kMQReadPositionNewest;
+    size_t mOverflowReadLag = 0;
+
+    mutable MQReadOverflowStats mReadOverflowStats;
+
+    /*
+     * Statistics grantor, if the FMQ was created with kMQStatistics.
+     */
+    SharedStats* mStats = nullptr;
+
+    /*
+     * Read threshold grantor, if the FMQ was created with
+     * kMQReadWakeThreshold. It holds the value the write pointer counter
+     * needs to reach for the blocked readers to be woken up, or 0 if no
+     * reader published a threshold.
+     */
+    std::atomic<uint64_t>* mReadThreshold = nullptr;
+
+    /*
+     * Upper bound and current value of the spin budget of the blocking
+     * methods, see setSpinWait(). The budget is only a hint, so threads
+     * sharing this object update it with relaxed atomics.
+     */
+    int64_t mMaxSpinNanos = 0;
+    std::atomic<int64_t> mSpinBudgetNanos{0};
+
+    /*
+     * Wake policy of the writes, see setWakePolicy(). mWakeDelayNanos is the
+     * resolved MQWakePolicy::maxDelayNanos. The items written, the
+     * notification bits whose wake up on mEventFlag was deferred since the
+     * last wake up and the CLOCK_MONOTONIC time of the first deferral (0 if
+     * none) are atomic, since writer threads may share this object.
+     */
+    MQWakePolicy mWakePolicy;
+    bool mWakePolicyEnabled = false;
+    int64_t mWakeDelayNanos = 0;
+    std::atomic<size_t> mDeferredWakeMessages{0};
+    std::atomic<uint32_t> mDeferredWakeNotification{0};
+    std::atomic<int64_t> mDeferredSinceNanos{0};
+    std::atomic<int64_t> mLastWakeNanos{0};
+
+    /*
+     * Thread of MQWakePolicy::flushThread, see scheduleFlush().
+     * mFlushDeadlineNanos is the CLOCK_MONOTONIC time of the next deferred
+     * wake up it performs, 0 if none is scheduled.
+     */
+    pthread_t mFlushThread;
+    bool mFlushThreadStarted = false;
+    std::mutex mFlushMutex;
+    std::condition_variable mFlushCondition;
+    int64_t mFlushDeadlineNanos = 0;
+    bool mFlushThreadExit = false;
+
+    /*
+     * Mapping options (kMQPrefault, kMQLockMemory, kMQHugePages) applied by
+     * mapGrantors() and mapGrantorDescr(). mMemoryLocked is cleared if any of the mappings
+     * could not be locked.
+     */
+    uint32_t mMappingFlags = 0;
+    bool mMemoryLocked = false;
+
+    /*
+     * Mapping of the pages of the fd with index 'fdIndex' in the native
+     * handle which hold grantors referencing it. There are two mappings of
+     * the fd of a mirrored ring buffer if grantors follow the ring buffer.
+     */
+    struct FdMapping {
+        int fdIndex;
+        size_t offset;
+        size_t length;
+        uint8_t* base;
+    };
+    std::vector<FdMapping> mFdMappings;
+
+    /*
+     * Last values of the peer's counter observed by this endpoint. The
+     * writer of a synchronized FMQ only reloads the read pointer counter when
+     * mCachedReadPtr indicates that the FMQ is full and the reader only
+     * reloads the write pointer counter when mCachedWritePtr indicates that
+     * the FMQ is empty. This avoids a cache miss on the peer's counter for
+     * most reads and writes.
+     */
+    mutable uint64_t mCachedReadPtr = 0;
+    mutable uint64_t mCachedWritePtr = 0;
+
+    /*
+     * Slot sequence numbers of the multi-producer flavors, truncated to 32
+     * bits. The writer of the item with index i = position / sizeof(T) sets
+     * the sequence number of its slot to i + 1 when it commits the item. With
+     * kRecycledSlots, a slot is only free for the writer of item i once its
+     * sequence number is i, and the reader of item i sets it to
+     * i + getQuantumCount() once the item is claimed.
+     */
+    std::atomic<uint32_t>* mSlotSeq = nullptr;
+
+    /*
+     * Write pointer counter value at the start of the last reservation made
+     * by beginWrite() on this object. Used by commitWrite(size_t) for the
+     * multi-producer flavors.
+     */
+    mutable uint64_t mLastWritePtr = 0;
+
+    /*
+     * Read pointer counter value at the start of the last read started by
+     * beginRead() on this object. Used by commitRead(size_t) for the
+     * multi-consumer flavors.
+     */
+    mutable uint64_t mLastReadPtr = 0;
+
+    /*
+     * Number of bytes covered by the record returned by the last
+     * beginReadRecord() call, including its padding and header.
+     */
+    size_t mLastRecordBytes = 0;
+    /*
+     * Whether the read and write pointer counters are 32 bits wide (see
+     * kMQ32BitCounters).
+     */
+    bool m32BitCounters = false;
+    PointerCounter mReadPtr;
+    PointerCounter mWritePtr;
+
+    std::atomic<uint32_t>* mEvFlagWord = nullptr;
+
+    /*
+     * This EventFlag object will be owned by the FMQ and will have the same
+     * lifetime.
+     */
+    android::hardware::EventFlag* mEventFlag = nullptr;
+};
+
+template <typename T, MQFlavor flavor>
+T* MessageQueue<T, flavor>::MemTransaction::getSlot(size_t idx) {
+    size_t firstRegionLength = first.getLength();
+    size_t secondRegionLength = second.getLength();
+
+    if (idx > firstRegionLength + secondRegionLength) {
+        return nullptr;
+    }
+
+    if (idx < firstRegionLength) {
+        return first.getAddress() + idx;
+    }
+
+    return second.getAddress() + idx - firstRegionLength;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::MemTransaction::getMemRegionInfo(size_t startIdx,
+                                                               size_t nMessages,
+                                                               size_t& firstCount,
+                                                               size_t& secondCount,
+                                                               T** firstBaseAddress,
+                                                               T** secondBaseAddress) {
+    size_t firstRegionLength = first.getLength();
+    size_t secondRegionLength = second.getLength();
+
+    if (startIdx + nMessages > firstRegionLength + secondRegionLength) {
+        /*
+         * Return false if 'nMessages' starting at 'startIdx' cannot be
+         * accomodated by the MemTransaction object.
+         */
+        return false;
+    }
+
+    /* Number of messages to be read/written to the first MemRegion. */
+    firstCount = startIdx < firstRegionLength ?
+            std::min(nMessages, firstRegionLength - startIdx) : 0;
+
+    /* Number of messages to be read/written to the second MemRegion. */
+    secondCount = nMessages - firstCount;
+
+    if (firstCount != 0) {
+        *firstBaseAddress = first.getAddress() + startIdx;
+    }
+
+    if (secondCount != 0) {
+        size_t secondStartIdx = startIdx > firstRegionLength ? startIdx - firstRegionLength : 0;
+        *secondBaseAddress = second.getAddress() + secondStartIdx;
+    }
+
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::MemTransaction::copyFrom(T* data, size_t startIdx, size_t nMessages,
+                                                       MQCopyPolicy policy) {
+    if (data == nullptr) {
+        return false;
+    }
+
+    size_t firstReadCount = 0, secondReadCount = 0;
+    T* firstBaseAddress = nullptr, * secondBaseAddress = nullptr;
+
+    if (getMemRegionInfo(startIdx,
+                         nMessages,
+                         firstReadCount,
+                         secondReadCount,
+                         &firstBaseAddress,
+                         &secondBaseAddress) == false) {
+        /*
+         * Returns false if 'startIdx' and 'nMessages' are invalid for this
+         * MemTransaction object.
+         */
+        return false;
+    }
+
+    if (firstReadCount != 0) {
+        copyItems(data, firstBaseAddress, firstReadCount, policy);
+    }
+
+    if (secondReadCount != 0) {
+        copyItems(data + firstReadCount, secondBaseAddress, secondReadCount, policy);
+    }
+
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::MemTransaction::copyTo(const T* data,
+                                                     size_t startIdx,
+                                                     size_t nMessages,
+                                                     MQCopyPolicy policy) {
+    if (data == nullptr) {
+        return false;
+    }
+
+    size_t firstWriteCount = 0, secondWriteCount = 0;
+    T * firstBaseAddress = nullptr, * secondBaseAddress = nullptr;
+
+    if (getMemRegionInfo(startIdx,
+                         nMessages,
+                         firstWriteCount,
+                         secondWriteCount,
+                         &firstBaseAddress,
+                         &secondBaseAddress) == false) {
+        /*
+         * Returns false if 'startIdx' and 'nMessages' are invalid for this
+         * MemTransaction object.
+         */
+        return false;
+    }
+
+    if (firstWriteCount != 0) {
+        copyItems(firstBaseAddress, data, firstWriteCount, policy);
+    }
+
+    if (secondWriteCount != 0) {
+        copyItems(secondBaseAddress, data + firstWriteCount, secondWriteCount, policy);
+    }
+
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::copyBytes(void* dst, const void* src, size_t size,
+                                        MQCopyPolicy policy) {
+    switch (policy) {
+        case kMQCopyNonTemporal:
+            details::copyNonTemporal(dst, src, size);
+            break;
+        case kMQCopyPrefetch:
+            details::copyPrefetched(dst, src, size);
+            break;
+        default:
+            memcpy(dst, src, size);
+            break;
+    }
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::copyItems(T* dst, const T* src, size_t nMessages,
+                                        MQCopyPolicy policy) {
+    if (policy == kMQCopyDefault && sizeof(T) <= kInlineCopyMaxItemSize) {
+        switch (nMessages) {
+            case 1:
+                memcpy(dst, src, sizeof(T));
+                return;
+            case 2:
+                memcpy(dst, src, 2 * sizeof(T));
+                return;
+            case 3:
+                memcpy(dst, src, 3 * sizeof(T));
+                return;
+            case 4:
+                memcpy(dst, src, 4 * sizeof(T));
+                return;
+            default:
+                break;
+        }
+    }
+    copyBytes(dst, src, nMessages * sizeof(T), policy);
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::WriteBatch::append(const T* data, size_t nMessages) {
+    if (nMessages > reserved - count || !tx.copyTo(data, count /* startIdx */, nMessages)) {
+        return false;
+    }
+    count += nMessages;
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::WriteBatch::appendRecord(const T* data, size_t length) {
+    static_assert(sizeof(T) == 1, "Records are only supported by byte FMQs");
+    if (length > reserved - count || reserved - count - length < kRecordHeaderSize) {
+        return false;
+    }
+    size_t nBytes = kRecordHeaderSize + length;
+    /*
+     * Records never wrap around the end of the ring buffer.
+     */
+    size_t padding = (count < wrapIdx && wrapIdx - count < nBytes) ? wrapIdx - count : 0;
+    if (padding > reserved - count - nBytes ||
+        !copyRecord(&tx, count /* startIdx */, padding, data, length)) {
+        return false;
+    }
+    count += padding + nBytes;
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::initMemory(bool resetPointers, uint32_t mappingFlags) {
+    /*
+     * Verify that the the Descriptor contains the minimum number of grantors
+     * the native_handle is valid and T matches quantum size.
+     */
+    if ((mDesc == nullptr) || !mDesc->isHandleValid() ||
+        (mDesc->countGrantors() < Descriptor::kMinGrantorCount) ||
+        (mDesc->getQuantum() != sizeof(T))) {
+        return;
+    }
+
+    /*
+     * The multi-producer flavors require the slot sequence number grantor.
+     */
+    if (kMultiProducer &&
+        (mDesc->countGrantors() <= SLOTSEQPOS ||
+         mDesc->grantors()[SLOTSEQPOS].extent <
+                 mDesc->getSize() / sizeof(T) * sizeof(std::atomic<uint32_t>))) {
+        return;
+    }
+
+    /*
+     * The read threshold only describes the progress of a single producer
+     * and requires its grantor.
+     */
+    bool readWakeThreshold =
+            (mDesc->grantors()[Descriptor::DATAPTRPOS].flags & kMQReadWakeThreshold) != 0;
+    if (readWakeThreshold &&
+        (kMultiProducer || kMultiConsumer || mDesc->countGrantors() <= READTHRESHOLDPOS ||
+         mDesc->grantors()[READTHRESHOLDPOS].extent < sizeof(std::atomic<uint64_t>) ||
+         mDesc->grantors()[READTHRESHOLDPOS].offset % alignof(std::atomic<uint64_t>) != 0)) {
+        details::logError("Read wake thresholds require their grantor and a single producer "
+                          "and consumer");
+        return;
+    }
+
+    /*
+     * With a single slot, the sequence number of a committed item would be
+     * the same as the one of a slot free for the next writer.
+     */
+    if (kRecycledSlots && mDesc->getSize() / sizeof(T) < 2) {
+        return;
+    }
+
+    mRingSize = mDesc->getSize();
+    mQuantumCount = mRingSize / sizeof(T);
+    /*
+     * The mask is used whenever the size of the ring buffer permits it
+     * irrespective of kMQPowerOfTwoCapacity, since peers created by an older
+     * libfmq may also have a ring buffer whose size is a power of two.
+     */
+    mRingMask = (mRingSize > 1 && (mRingSize & (mRingSize - 1)) == 0) ? mRingSize - 1 : 0;
+
+    /*
+     * 32 bit counters only map consistently to ring buffer offsets across
+     * their wrap around if the size of the ring buffer divides 2^32.
+     */
+    m32BitCounters = (mDesc->grantors()[Descriptor::DATAPTRPOS].flags & kMQ32BitCounters) != 0;
+    if (m32BitCounters &&
+        (kMultiProducer || mRingMask == 0 || mRingSize > (static_cast<uint64_t>(1) << 31))) {
+        details::logError("32 bit counters require a power of two ring buffer size "
+                          "and a single producer");
+        mRingSize = 0;
+        mQuantumCount = 0;
+        return;
+    }
+
+    mMappingFlags = (mDesc->grantors()[Descriptor::DATAPTRPOS].flags | mappingFlags) &
+            (kMQPrefault | kMQLockMemory | kMQHugePages);
+    mMemoryLocked = (mMappingFlags & kMQLockMemory) != 0;
+
+    /*
+     * A mirrored ring buffer needs a mapping of its own, so it is mapped
+     * before the other grantors are.
+     */
+    if (mDesc->grantors()[Descriptor::DATAPTRPOS].flags & kMQMirroredRing) {
+        mRing = reinterpret_cast<uint8_t*>(mapGrantorDescr(Descriptor::DATAPTRPOS,
+                                                           true /* mirrored */));
+        mRingMirrored = mRing != nullptr;
+    }
+    mapGrantors(mRingMirrored /* skipRing */);
+
+    if (flavor != kUnsynchronizedWrite) {
+        mReadPtr.init(mapGrantorDescr(Descriptor::READPTRPOS), m32BitCounters);
+    } else {
+        /*
+         * The unsynchronized write flavor of the FMQ may have multiple readers
+         * and each reader would have their own read pointer counter.
+         */
+        mReadPtr.allocate(m32BitCounters);
+    }
+
+    details::check(mReadPtr.isValid());
+
+    mWritePtr.init(mapGrantorDescr(Descriptor::WRITEPTRPOS), m32BitCounters);
+    details::check(mWritePtr.isValid());
+
+    if (resetPointers) {
+        mReadPtr.store(0, std::memory_order_release);
+        mWritePtr.store(0, std::memory_order_release);
+    } else if (flavor == kUnsynchronizedWrite) {
+        // Always reset the read pointer.
+        mReadPtr.store(0, std::memory_order_release);
+    }
+
+    /*
+     * Start from the current values of the counters rather than 0. Otherwise,
+     * with 32 bit counters close to their wrap around, the distance from the
+     * cached copy of the peer's counter could look like a valid amount of
+     * space or data.
+     */
+    mCachedReadPtr = mReadPtr.load(std::memory_order_acquire);
+    mCachedWritePtr = mWritePtr.load(std::memory_order_acquire);
+
+    if (mRing == nullptr) {
+        mRing = reinterpret_cast<uint8_t*>(mapGrantorDescr(Descriptor::DATAPTRPOS));
+    }
+    details::check(mRing != nullptr);
+
+    if (kMultiProducer) {
+        mSlotSeq = static_cast<std::atomic<uint32_t>*>(mapGrantorDescr(SLOTSEQPOS));
+        details::check(mSlotSeq != nullptr);
+        /*
+         * Sequence numbers left over from before the reset could otherwise
+         * match the ones expected after it. With kRecycledSlots, every slot
+         * starts out free for the writer of the first item it will hold.
+         */
+        if (resetPointers) {
+            for (size_t i = 0; i < mQuantumCount; i++) {
+                mSlotSeq[i].store(kRecycledSlots ? static_cast<uint32_t>(i) : 0,
+                                  std::memory_order_relaxed);
+            }
+        }
+    }
+
+    mEvFlagWord = static_cast<std::atomic<uint32_t>*>(mapGrantorDescr(Descriptor::EVFLAGWORDPOS));
+    if (mEvFlagWord != nullptr) {
+        android::hardware::EventFlag::createEventFlag(
+                mEvFlagWord, &mEventFlag,
+                (mDesc->grantors()[Descriptor::DATAPTRPOS].flags & kMQEventFlagWaiterTracking) !=
+                        0 /* trackWaiters */);
+    }
+
+    if (mDesc->countGrantors() > STATSPOS &&
+        mDesc->grantors()[STATSPOS].extent >= sizeof(SharedStats) &&
+        mDesc->grantors()[STATSPOS].offset % alignof(SharedStats) == 0) {
+        mStats = static_cast<SharedStats*>(mapGrantorDescr(STATSPOS));
+    }
+
+    if (readWakeThreshold) {
+        mReadThreshold = static_cast<std::atomic<uint64_t>*>(mapGrantorDescr(READTHRESHOLDPOS));
+        details::check(mReadThreshold != nullptr);
+    }
+}
+
+template <typename T, MQFlavor flavor>
+MessageQueue<T, flavor>::MessageQueue(const Descriptor& Desc, bool resetPointers,
+                                      uint32_t mappingFlags) {
+    mDesc = std::unique_ptr<Descriptor>(new (std::nothrow) Descriptor(Desc));
+    if (mDesc == nullptr) {
+        return;
+    }
+
+    initMemory(resetPointers, mappingFlags);
+}
+
+template <typename T, MQFlavor flavor>
+MessageQueue<T, flavor>::MessageQueue(const Descriptor& Desc, MQReadPosition attachPosition,
+                                      size_t attachLag, uint32_t mappingFlags)
+    : MessageQueue(Desc, false /* resetPointers */, mappingFlags) {
+    if (flavor == kUnsynchronizedWrite && isValid()) {
+        mReadPtr.store(getReadPosition(attachPosition, attachLag, mCachedWritePtr),
+                       std::memory_order_release);
+    }
+}
+
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+uint64_t MessageQueue<T, flavor>::getReadPosition(MQReadPosition position, size_t lag,
+                                                  uint64_t writePtr) const {
+    size_t lagBytes = 0;
+    if (position == kMQReadPositionOldest) {
+        lagBytes = mRingSize;
+    } else if (position == kMQReadPositionLag) {
+        lagBytes = std::min(lag, getQuantumCount()) * sizeof(T);
+    }
+    /*
+     * Never move before the first item ever written. With 32 bit counters,
+     * this is only known before their first wrap around.
+     */
+    if (lagBytes > writePtr) {
+        lagBytes = static_cast<size_t>(writePtr);
+    }
+    return writePtr - lagBytes;
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::handleReadOverflow(uint64_t readPtr, uint64_t writePtr) const {
+    uint64_t newReadPtr = getReadPosition(mOverflowReadPosition, mOverflowReadLag, writePtr);
+    mReadPtr.store(newReadPtr, std::memory_order_release);
+
+    mReadOverflowStats.overflowCount++;
+    mReadOverflowStats.messagesLost += getCounterDistance(newReadPtr, readPtr) / sizeof(T);
+    mReadOverflowStats.lastOverflowTimeNs = android::elapsedRealtimeNano();
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::addStat(std::atomic<uint64_t>& counter, uint64_t value,
+                                      bool exclusive) {
+    if (exclusive) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    } else {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::statsTransfer(bool isWrite, size_t nMessages) const {
+    if (mStats == nullptr) {
+        return;
+    }
+    bool exclusive = isWrite ? kExclusiveWriterStats : kExclusiveReaderStats;
+    SharedEndpointStats& stats = isWrite ? mStats->writer : mStats->reader;
+    addStat(stats.messages, nMessages, exclusive);
+    addStat(stats.bytes, nMessages * sizeof(T), exclusive);
+}
+
+template <typename T, MQFlavor flavor>
+thread_local bool MessageQueue<T, flavor>::sRetryingTransfer = false;
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::statsUnavailable(bool isWrite) const {
+    if (mStats == nullptr || sRetryingTransfer) {
+        return;
+    }
+    addStat(isWrite ? mStats->writer.unavailableEvents : mStats->reader.unavailableEvents, 1,
+            isWrite ? kExclusiveWriterStats : kExclusiveReaderStats);
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::statsWait(bool isWrite, int64_t waitTimeNs) const {
+    if (mStats == nullptr) {
+        return;
+    }
+    bool exclusive = isWrite ? kExclusiveWriterStats : kExclusiveReaderStats;
+    SharedEndpointStats& stats = isWrite ? mStats->writer : mStats->reader;
+    size_t bucket = 0;
+    if (waitTimeNs > 1) {
+        bucket = std::min<size_t>(63 - __builtin_clzll(static_cast<uint64_t>(waitTimeNs)),
+                                  kMQWaitTimeBuckets - 1);
+    }
+    addStat(stats.blockingWaits, 1, exclusive);
+    addStat(stats.waitTimeHistogram[bucket], 1, exclusive);
+}
 
-    if (idx > firstRegionLength + secondRegionLength) {
-        return nullptr;
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::statsWake(bool isWrite) const {
+    if (mStats == nullptr) {
+        return;
     }
+    /*
+     * The flush thread performs deferred wake ups of the writer concurrently
+     * with its writes.
+     */
+    addStat(isWrite ? mStats->writer.wakes : mStats->reader.wakes, 1,
+            isWrite ? kExclusiveWriterStats && !mFlushThreadStarted : kExclusiveReaderStats);
+}
 
-    if (idx < firstRegionLength) {
-        return first.getAddress() + idx;
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::wakeEventFlag(android::hardware::EventFlag* evFlag,
+                                            uint32_t bitmask, bool wakeOne,
+                                            bool isWrite) const {
+    bool syscalled = false;
+    if (wakeOne) {
+        evFlag->wakeOne(bitmask, &syscalled);
+    } else {
+        evFlag->wake(bitmask, &syscalled);
+    }
+    if (syscalled) {
+        statsWake(isWrite);
     }
+}
 
-    return second.getAddress() + idx - firstRegionLength;
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::getStats(MQStats* stats) const {
+    if (stats == nullptr || mStats == nullptr) {
+        return false;
+    }
+    const SharedEndpointStats* shared[] = {&mStats->writer, &mStats->reader};
+    MQEndpointStats* snapshots[] = {&stats->writer, &stats->reader};
+    for (size_t i = 0; i < 2; i++) {
+        snapshots[i]->messages = shared[i]->messages.load(std::memory_order_relaxed);
+        snapshots[i]->bytes = shared[i]->bytes.load(std::memory_order_relaxed);
+        snapshots[i]->unavailableEvents =
+                shared[i]->unavailableEvents.load(std::memory_order_relaxed);
+        snapshots[i]->blockingWaits = shared[i]->blockingWaits.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket < kMQWaitTimeBuckets; bucket++) {
+            snapshots[i]->waitTimeHistogram[bucket] =
+                    shared[i]->waitTimeHistogram[bucket].load(std::memory_order_relaxed);
+        }
+        snapshots[i]->wakes = shared[i]->wakes.load(std::memory_order_relaxed);
+    }
+    return true;
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::MemTransaction::getMemRegionInfo(size_t startIdx,
-                                                               size_t nMessages,
-                                                               size_t& firstCount,
-                                                               size_t& secondCount,
-                                                               T** firstBaseAddress,
-                                                               T** secondBaseAddress) {
-    size_t firstRegionLength = first.getLength();
-    size_t secondRegionLength = second.getLength();
+MessageQueue<T, flavor>::MessageQueue(size_t numElementsInQueue, bool configureEventFlagWord,
+                                      uint32_t creationFlags) {
+    if (creationFlags & kMQ32BitCounters) {
+        creationFlags |= kMQPowerOfTwoCapacity;
+    }
 
-    if (startIdx + nMessages > firstRegionLength + secondRegionLength) {
+    if (creationFlags & kMQPowerOfTwoCapacity) {
+        // Check if rounding up the capacity would not overflow size_t
+        if (numElementsInQueue > (SIZE_MAX >> 1) + 1) {
+            return;
+        }
+        size_t capacity = 1;
+        while (capacity < numElementsInQueue) {
+            capacity <<= 1;
+        }
+        numElementsInQueue = capacity;
+    }
+
+    if (creationFlags & kMQMirroredRing) {
         /*
-         * Return false if 'nMessages' starting at 'startIdx' cannot be
-         * accomodated by the MemTransaction object.
+         * The size of a mirrored ring buffer must be a multiple of the page
+         * size as well as of sizeof(T). Since PAGE_SIZE is a power of two,
+         * their greatest common divisor is the lowest set bit of sizeof(T)
+         * (capped at PAGE_SIZE).
          */
-        return false;
+        size_t gcd = std::min<size_t>(sizeof(T) & (~sizeof(T) + 1), PAGE_SIZE);
+        size_t elementsPerPageMultiple = PAGE_SIZE / gcd;
+        // Check if rounding up the capacity would not overflow size_t
+        if (numElementsInQueue > SIZE_MAX - elementsPerPageMultiple) {
+            return;
+        }
+        numElementsInQueue = (numElementsInQueue + elementsPerPageMultiple - 1) /
+                elementsPerPageMultiple * elementsPerPageMultiple;
     }
 
-    /* Number of messages to be read/written to the first MemRegion. */
-    firstCount = startIdx < firstRegionLength ?
-            std::min(nMessages, firstRegionLength - startIdx) : 0;
+    // Check if the buffer size would not overflow size_t
+    if (numElementsInQueue > SIZE_MAX / sizeof(T)) {
+        return;
+    }
+    /*
+     * The FMQ needs to allocate memory for the ringbuffer as well as for the
+     * read and write pointer counters. If an EventFlag word is to be configured,
+     * we also need to allocate memory for the same/
+     */
+    size_t kQueueSizeBytes = numElementsInQueue * sizeof(T);
+    size_t kMetaDataSize = 2 * sizeof(android::hardware::RingBufferPosition);
 
-    /* Number of messages to be read/written to the second MemRegion. */
-    secondCount = nMessages - firstCount;
+    if (configureEventFlagWord) {
+        kMetaDataSize+= sizeof(std::atomic<uint32_t>);
+    }
 
-    if (firstCount != 0) {
-        *firstBaseAddress = first.getAddress() + startIdx;
+    /*
+     * If the counters and the EventFlag word are to be placed on their own
+     * cache lines or the ring buffer is to be mirrored, libfmq computes the
+     * grantors instead of the Descriptor. The metadata then occupies
+     * everything in front of the ring buffer.
+     */
+    std::vector<android::hardware::GrantorDescriptor> grantors;
+    if ((creationFlags & (kMQCacheLineIsolation | kMQCacheLineIsolation128 | kMQMirroredRing |
+                          kMQStatistics | kMQReadWakeThreshold)) ||
+        kMultiProducer) {
+        grantors = getGrantors(kQueueSizeBytes, configureEventFlagWord, creationFlags);
     }
 
-    if (secondCount != 0) {
-        size_t secondStartIdx = startIdx > firstRegionLength ? startIdx - firstRegionLength : 0;
-        *secondBaseAddress = second.getAddress() + secondStartIdx;
+    /*
+     * Ashmem memory region size needs to be specified in page-aligned bytes.
+     * kQueueSizeBytes needs to be aligned to word boundary so that all offsets
+     * in the grantorDescriptor will be word aligned.
+     */
+    size_t kAshmemSize = Descriptor::alignToWordBoundary(kQueueSizeBytes) + kMetaDataSize;
+    if (!grantors.empty()) {
+        kAshmemSize = 0;
+        for (const auto& grantor : grantors) {
+            kAshmemSize = std::max<size_t>(kAshmemSize, grantor.offset + grantor.extent);
+        }
     }
+    size_t kPageSize = (creationFlags & kMQHugePages) ? kHugePageSize : PAGE_SIZE;
+    size_t kAshmemSizePageAligned = (kAshmemSize + kPageSize - 1) & ~(kPageSize - 1);
 
-    return true;
+    /*
+     * Create a shared memory region to map the memory for the ringbuffer,
+     * read counter and write counter.
+     */
+    int ashmemFd = createSharedMemory(kAshmemSizePageAligned, creationFlags);
+    if (ashmemFd < 0) {
+        return;
+    }
+
+    /*
+     * The native handle will contain the fds to be mapped.
+     */
+    native_handle_t* mqHandle =
+            native_handle_create(1 /* numFds */, 0 /* numInts */);
+    if (mqHandle == nullptr) {
+        return;
+    }
+
+    mqHandle->data[0] = ashmemFd;
+    if (grantors.empty()) {
+        mDesc = std::unique_ptr<Descriptor>(new (std::nothrow) Descriptor(kQueueSizeBytes,
+                                                                          mqHandle,
+                                                                          sizeof(T),
+                                                                          configureEventFlagWord));
+    } else {
+        mDesc = std::unique_ptr<Descriptor>(new (std::nothrow) Descriptor(grantors,
+                                                                          mqHandle,
+                                                                          sizeof(T)));
+    }
+    if (mDesc == nullptr) {
+        return;
+    }
+    mDesc->grantors()[Descriptor::DATAPTRPOS].flags |= creationFlags;
+    initMemory(true, 0 /* mappingFlags */);
+
+    /*
+     * Nobody can be waiting on the EventFlag word of a new FMQ yet, so the
+     * waiter bits set when waiter tracking was enabled on it are cleared.
+     */
+    if (mEvFlagWord != nullptr && (creationFlags & kMQEventFlagWaiterTracking)) {
+        mEvFlagWord->store(android::hardware::EventFlag::kTrackWaitersBit,
+                           std::memory_order_relaxed);
+    }
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::MemTransaction::copyFrom(T* data, size_t startIdx, size_t nMessages) {
-    if (data == nullptr) {
+std::vector<android::hardware::GrantorDescriptor>
+MessageQueue<T, flavor>::getGrantors(size_t queueSizeBytes,
+                                     bool configureEventFlagWord,
+                                     uint32_t creationFlags) {
+    size_t grantorCount = configureEventFlagWord ? Descriptor::kMinGrantorCountForEvFlagSupport
+                                                 : Descriptor::kMinGrantorCount;
+    if (kMultiProducer) {
+        grantorCount = SLOTSEQPOS + 1;
+    }
+    if (creationFlags & kMQStatistics) {
+        grantorCount = STATSPOS + 1;
+    }
+    if (creationFlags & kMQReadWakeThreshold) {
+        grantorCount = READTHRESHOLDPOS + 1;
+    }
+    /*
+     * Grantors which are not configured are left with a zero extent.
+     */
+    std::vector<android::hardware::GrantorDescriptor> grantors(
+            grantorCount, {0 /* grantor flags */, 0 /* fdIndex */, 0 /* offset */, 0 /* extent */});
+    /*
+     * The grantors are laid out in the order read pointer counter, write
+     * pointer counter, EventFlag word and ring buffer. With cache line
+     * isolation, each of them starts on a cache line boundary. A mirrored
+     * ring buffer starts on a page boundary.
+     */
+    size_t alignment = sizeof(android::hardware::RingBufferPosition);
+    if (creationFlags & kMQCacheLineIsolation128) {
+        alignment = 128;
+    } else if (creationFlags & kMQCacheLineIsolation) {
+        alignment = 64;
+    }
+
+    uint32_t offset = 0;
+    grantors[Descriptor::READPTRPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                        sizeof(android::hardware::RingBufferPosition)};
+    offset += alignment;
+    grantors[Descriptor::WRITEPTRPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                         sizeof(android::hardware::RingBufferPosition)};
+    offset += alignment;
+    if (configureEventFlagWord) {
+        grantors[Descriptor::EVFLAGWORDPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                               sizeof(std::atomic<uint32_t>)};
+        offset += alignment;
+    }
+    if (creationFlags & kMQMirroredRing) {
+        offset = (offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+    grantors[Descriptor::DATAPTRPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                        queueSizeBytes};
+    offset = Descriptor::alignToWordBoundary(offset + queueSizeBytes);
+    if (kMultiProducer) {
+        grantors[SLOTSEQPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                queueSizeBytes / sizeof(T) * sizeof(std::atomic<uint32_t>)};
+        offset += grantors[SLOTSEQPOS].extent;
+    }
+    if (creationFlags & kMQStatistics) {
+        offset = (offset + alignof(SharedStats) - 1) & ~(alignof(SharedStats) - 1);
+        grantors[STATSPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                              sizeof(SharedStats)};
+        offset += grantors[STATSPOS].extent;
+    }
+    if (creationFlags & kMQReadWakeThreshold) {
+        offset = (offset + alignment - 1) & ~(alignment - 1);
+        grantors[READTHRESHOLDPOS] = {0 /* grantor flags */, 0 /* fdIndex */, offset,
+                                      sizeof(std::atomic<uint64_t>)};
+    }
+    return grantors;
+}
+
+template <typename T, MQFlavor flavor>
+int MessageQueue<T, flavor>::createSharedMemory(size_t size, uint32_t creationFlags) {
+    if (!(creationFlags & (kMQMemfd | kMQHugePages))) {
+        int fd = ashmem_create_region("MessageQueue", size);
+        if (fd >= 0) {
+            ashmem_set_prot_region(fd, PROT_READ | PROT_WRITE);
+            return fd;
+        }
+        /*
+         * Hosts without ashmem get the same FMQ from a memfd, as if kMQMemfd
+         * had been passed.
+         */
+    }
+
+    unsigned int memfdFlags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    if (creationFlags & kMQHugePages) {
+        memfdFlags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    }
+    int fd = memfd_create("MessageQueue", memfdFlags);
+    if (fd < 0) {
+        details::logError(std::string("memfd_create failed: ") + strerror(errno));
+        return -1;
+    }
+    /*
+     * The huge pages are allocated up front, so that running out of them
+     * makes the creation of the FMQ fail instead of a later page fault.
+     */
+    if (ftruncate(fd, size) != 0 ||
+        ((creationFlags & kMQHugePages) && fallocate(fd, 0, 0, size) != 0) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        details::logError(std::string("Failed to allocate FMQ memfd: ") + strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+template <typename T, MQFlavor flavor>
+MessageQueue<T, flavor>::~MessageQueue() {
+    stopFlushThread();
+    if (mEventFlag != nullptr) {
+        flushNotifications();
+    }
+    if (flavor == kUnsynchronizedWrite && mReadPtr.isValid()) {
+        mReadPtr.release();
+    }
+    if (mEventFlag != nullptr) {
+        android::hardware::EventFlag::deleteEventFlag(&mEventFlag);
+    }
+    if (mRingMirrored) {
+        unmapGrantorDescr(mRing, Descriptor::DATAPTRPOS);
+    }
+    if (mDesc != nullptr) {
+        unmapGrantors();
+    }
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::write(const T* data) {
+    uint64_t writePtr;
+    if (!reserveWritePosition(1, &writePtr)) {
         return false;
     }
+    memcpy(mRing + getRingOffset(writePtr), data, sizeof(T));
+    if (kMultiProducer) {
+        storeSlotSeqs(writePtr, 1, 1 /* seqOffset */);
+        statsTransfer(true /* isWrite */, 1);
+        return true;
+    }
+    return commitWrite(1);
+}
 
-    size_t firstReadCount = 0, secondReadCount = 0;
-    T* firstBaseAddress = nullptr, * secondBaseAddress = nullptr;
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::read(T* data) {
+    uint64_t readPtr;
+    if (kMultiConsumer) {
+        /*
+         * As in read(T*, size_t), the item is copied out before it is claimed.
+         */
+        while (prepareReadPosition(1, &readPtr)) {
+            memcpy(data, mRing + getRingOffset(readPtr), sizeof(T));
+            if (claimRead(readPtr, 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (!prepareReadPosition(1, &readPtr)) {
+        return false;
+    }
+    memcpy(data, mRing + getRingOffset(readPtr), sizeof(T));
+    return commitRead(1);
+}
 
-    if (getMemRegionInfo(startIdx,
-                         nMessages,
-                         firstReadCount,
-                         secondReadCount,
-                         &firstBaseAddress,
-                         &secondBaseAddress) == false) {
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::write(const T* data, size_t nMessages) {
+    MemTransaction tx;
+    return reserveWrite(nMessages, &tx) &&
+            tx.copyTo(data, 0 /* startIdx */, nMessages, mWriteCopyPolicy) &&
+            commitWrite(tx);
+}
+
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+size_t MessageQueue<T, flavor>::writeUpTo(const T* data, size_t maxMessages) {
+    while (true) {
+        size_t nMessages = std::min(maxMessages, getQuantumCount());
+
+        if (kRecycledSlots) {
+            nMessages = countSlotSeqs(mWritePtr.load(std::memory_order_relaxed), nMessages,
+                                      0 /* seqOffset */);
+        } else if (kMultiProducer) {
+            auto writePtr = mWritePtr.load(std::memory_order_relaxed);
+            size_t nBytesAvailable =
+                    mRingSize -
+                    getCounterDistance(writePtr, mReadPtr.load(std::memory_order_acquire));
+            nMessages = std::min(nMessages, nBytesAvailable / sizeof(T));
+        } else if (kSynchronizedWrite) {
+            /*
+             * Only reload the read pointer counter if the cached copy indicates
+             * that 'nMessages' items do not fit.
+             */
+            auto writePtr = mWritePtr.load(std::memory_order_relaxed);
+            size_t nBytesDesired = nMessages * sizeof(T);
+            if (getCounterDistance(writePtr, mCachedReadPtr) > mRingSize - nBytesDesired) {
+                mCachedReadPtr = mReadPtr.load(std::memory_order_acquire);
+            }
+            size_t nBytesAvailable = mRingSize - getCounterDistance(writePtr, mCachedReadPtr);
+            nMessages = std::min(nMessages, nBytesAvailable / sizeof(T));
+        }
+
+        if (nMessages == 0) {
+            statsUnavailable(true /* isWrite */);
+            return 0;
+        }
+        if (write(data, nMessages)) {
+            return nMessages;
+        }
         /*
-         * Returns false if 'startIdx' and 'nMessages' are invalid for this
-         * MemTransaction object.
+         * With several writers, another writer may have reserved the space
+         * first. Retry with the space that is left.
          */
+        if (!kMultiProducer) {
+            return 0;
+        }
+    }
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::beginWriteBatch(size_t maxMessages, WriteBatch* batch) const {
+    /*
+     * Space reserved by the multi-producer flavors must be committed in full,
+     * so a partially filled batch could not be published.
+     */
+    if (batch == nullptr || kMultiProducer) {
         return false;
     }
 
-    if (firstReadCount != 0) {
-        memcpy(data, firstBaseAddress, firstReadCount * sizeof(T));
+    batch->count = 0;
+    if (!beginWrite(maxMessages, &batch->tx)) {
+        batch->reserved = 0;
+        return false;
     }
+    batch->reserved = maxMessages;
+    batch->wrapIdx = (mRingSize - getRingOffset(batch->tx.position)) / sizeof(T);
+    return true;
+}
 
-    if (secondReadCount != 0) {
-        memcpy(data + firstReadCount,
-               secondBaseAddress,
-               secondReadCount * sizeof(T));
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::commitWriteBatch(WriteBatch* batch,
+                                               uint32_t writeNotification,
+                                               android::hardware::EventFlag* evFlag) {
+    if (batch == nullptr) {
+        return false;
+    }
+
+    size_t count = batch->count;
+    batch->reserved = 0;
+    batch->count = 0;
+    if (count == 0) {
+        return true;
+    }
+
+    if (!commitWrite(count)) {
+        return false;
+    }
+
+    if (evFlag == nullptr) {
+        evFlag = mEventFlag;
+    }
+    if (evFlag != nullptr) {
+        wakeReaders(count, writeNotification, evFlag);
+    }
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::copyRecord(MemTransaction* memTx, size_t startIdx, size_t padding,
+                                         const T* data, size_t length) {
+    uint32_t header = kRecordSkip;
+    if (padding >= kRecordHeaderSize &&
+        !memTx->copyTo(reinterpret_cast<const T*>(&header), startIdx, kRecordHeaderSize)) {
+        return false;
+    }
+    header = static_cast<uint32_t>(length);
+    return memTx->copyTo(reinterpret_cast<const T*>(&header), startIdx + padding,
+                         kRecordHeaderSize) &&
+            (length == 0 ||
+             memTx->copyTo(data, startIdx + padding + kRecordHeaderSize, length));
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::writeRecord(const T* data, size_t length) {
+    static_assert(sizeof(T) == 1, "Records are only supported by byte FMQs");
+    if (kMultiProducer || kMultiConsumer || mRingSize < kRecordHeaderSize ||
+        length > mRingSize - kRecordHeaderSize || length >= kRecordSkip) {
+        return false;
+    }
+
+    /*
+     * The padding depends on where the record starts. Since there is a single
+     * writer, the write pointer counter does not move until the commit.
+     */
+    size_t nBytes = kRecordHeaderSize + length;
+    size_t contiguousBytes = mRingSize - getRingOffset(mWritePtr.load(std::memory_order_relaxed));
+    size_t padding = contiguousBytes < nBytes ? contiguousBytes : 0;
+
+    MemTransaction tx;
+    if (beginWrite(padding + nBytes, &tx)) {
+        return copyRecord(&tx, 0 /* startIdx */, padding, data, length) &&
+                commitWrite(padding + nBytes);
+    }
+
+    /*
+     * Commit the padding on its own, so that the write pointer counter moves
+     * to the start of the ring buffer, where the record fits once the reader
+     * freed enough space. Otherwise a record larger than the free space left
+     * after the padding could never be written.
+     */
+    uint32_t header = kRecordSkip;
+    if (padding == 0 || !beginWrite(padding, &tx) ||
+        (padding >= kRecordHeaderSize &&
+         !tx.copyTo(reinterpret_cast<const T*>(&header), 0 /* startIdx */, kRecordHeaderSize)) ||
+        !commitWrite(padding)) {
+        return false;
+    }
+    return beginWrite(nBytes, &tx) &&
+            copyRecord(&tx, 0 /* startIdx */, 0 /* padding */, data, length) &&
+            commitWrite(nBytes);
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::beginReadRecord(MemRegion* record) {
+    static_assert(sizeof(T) == 1, "Records are only supported by byte FMQs");
+    if (record == nullptr || kMultiProducer || kMultiConsumer) {
+        return false;
+    }
+
+    /*
+     * The padding is laid out at the end of the physical ring buffer even if
+     * it is mirrored, since the writer may not have mapped it mirrored.
+     */
+    size_t padding = 0;
+    size_t contiguousBytes = mRingSize - getRingOffset(mReadPtr.load(std::memory_order_relaxed));
+    uint32_t length = 0;
+    MemTransaction tx;
+    if (contiguousBytes < kRecordHeaderSize) {
+        padding = contiguousBytes;
+    } else {
+        if (!beginRead(kRecordHeaderSize, &tx) ||
+            !tx.copyFrom(reinterpret_cast<T*>(&length), 0 /* startIdx */, kRecordHeaderSize)) {
+            return false;
+        }
+        if (length == kRecordSkip) {
+            padding = contiguousBytes;
+        }
+    }
+    if (padding != 0 && !beginRead(padding + kRecordHeaderSize, &tx)) {
+        /*
+         * The writer may have committed the padding without the record
+         * following it (see writeRecord()). It is consumed right away, since
+         * the writer may need the space it occupies for that record.
+         */
+        return availableToReadBytes() >= padding && commitRead(padding) &&
+                beginReadRecord(record);
+    }
+    if (padding != 0 &&
+        !tx.copyFrom(reinterpret_cast<T*>(&length), padding, kRecordHeaderSize)) {
+        return false;
+    }
+
+    /*
+     * The whole record is committed at once, so it is available as soon as
+     * its header is. The length is checked anyway in case the header was
+     * overwritten by the writer of an unsynchronized FMQ.
+     */
+    size_t nBytes = padding + kRecordHeaderSize + length;
+    if (length > mRingSize - padding - kRecordHeaderSize || !beginRead(nBytes, &tx)) {
+        return false;
     }
+    *record = MemRegion(tx.getSlot(padding + kRecordHeaderSize), length);
+    mLastRecordBytes = nBytes;
+    return true;
+}
 
-    return true;
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::commitReadRecord() {
+    return commitRead(mLastRecordBytes);
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::MemTransaction::copyTo(const T* data,
-                                                     size_t startIdx,
-                                                     size_t nMessages) {
-    if (data == nullptr) {
-        return false;
+template <typename Transfer>
+size_t MessageQueue<T, flavor>::transferBlocking(Transfer transfer,
+                                                 bool isWrite,
+                                                 size_t minMessages,
+                                                 uint32_t waitNotification,
+                                                 uint32_t wakeNotification,
+                                                 int64_t deadlineNanos,
+                                                 android::hardware::EventFlag* evFlag) {
+    size_t result = transfer();
+    if (result) {
+        wakeAfterTransfer(isWrite, result, waitNotification, wakeNotification, evFlag);
+        return result;
     }
 
-    size_t firstWriteCount = 0, secondWriteCount = 0;
-    T * firstBaseAddress = nullptr, * secondBaseAddress = nullptr;
-
-    if (getMemRegionInfo(startIdx,
-                         nMessages,
-                         firstWriteCount,
-                         secondWriteCount,
-                         &firstBaseAddress,
-                         &secondBaseAddress) == false) {
-        /*
-         * Returns false if 'startIdx' and 'nMessages' are invalid for this
-         * MemTransaction object.
-         */
-        return false;
-    }
+    /*
+     * The retries below do not count as unavailable events again.
+     */
+    struct RetryScope {
+        RetryScope() { sRetryingTransfer = true; }
+        ~RetryScope() { sRetryingTransfer = false; }
+    } retryScope;
 
-    if (firstWriteCount != 0) {
-        memcpy(firstBaseAddress, data, firstWriteCount * sizeof(T));
+    /*
+     * The readers may be waiting for a deferred wake up to free the space
+     * this writer waits for.
+     */
+    if (isWrite) {
+        flushNotifications();
     }
 
-    if (secondWriteCount != 0) {
-        memcpy(secondBaseAddress,
-               data + firstWriteCount,
-               secondWriteCount * sizeof(T));
+    /*
+     * A deadline which already passed times out without waiting. The clock
+     * is read once per call, not after each wake-up.
+     */
+    if (deadlineNanos != 0 &&
+        (deadlineNanos < 0 || systemTime(SYSTEM_TIME_MONOTONIC) >= deadlineNanos)) {
+        return 0;
     }
 
-    return true;
-}
-
-template <typename T, MQFlavor flavor>
-void MessageQueue<T, flavor>::initMemory(bool resetPointers) {
     /*
-     * Verify that the the Descriptor contains the minimum number of grantors
-     * the native_handle is valid and T matches quantum size.
+     * Spin before waiting on the EventFlag.
      */
-    if ((mDesc == nullptr) || !mDesc->isHandleValid() ||
-        (mDesc->countGrantors() < Descriptor::kMinGrantorCount) ||
-        (mDesc->getQuantum() != sizeof(T))) {
-        return;
+    if (mMaxSpinNanos > 0) {
+        result = spinTransfer(transfer, deadlineNanos);
+        if (result) {
+            wakeAfterTransfer(isWrite, result, waitNotification, wakeNotification, evFlag);
+            return result;
+        }
     }
 
-    if (flavor == kSynchronizedReadWrite) {
-        mReadPtr = reinterpret_cast<std::atomic<uint64_t>*>(
-                mapGrantorDescr(Descriptor::READPTRPOS));
-    } else {
+    while (true) {
         /*
-         * The unsynchronized write flavor of the FMQ may have multiple readers
-         * and each reader would have their own read pointer counter.
+         * Publish the read threshold before the last attempt preceding the
+         * wait, so that either the attempt sees the items written before the
+         * writer checked the threshold or the writer sees the threshold.
          */
-        mReadPtr = new (std::nothrow) std::atomic<uint64_t>;
-    }
+        if (!isWrite && mReadThreshold != nullptr) {
+            publishReadThreshold(minMessages);
+            result = transfer();
+            if (result) {
+                break;
+            }
+        }
 
-    details::check(mReadPtr != nullptr);
+        /*
+         * wait() will return immediately if there was a pending
+         * notification. The deadline does not change across iterations, so
+         * it is not required to read the clock to account for the time
+         * spent in the previous ones.
+         */
+        uint32_t efState = 0;
+        int64_t waitStartNs = mStats != nullptr ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+        status_t status = evFlag->waitUntil(waitNotification,
+                                            &efState,
+                                            deadlineNanos,
+                                            true /* retry on spurious wake */);
+        if (mStats != nullptr) {
+            statsWait(isWrite, systemTime(SYSTEM_TIME_MONOTONIC) - waitStartNs);
+        }
 
-    mWritePtr =
-            reinterpret_cast<std::atomic<uint64_t>*>(mapGrantorDescr(Descriptor::WRITEPTRPOS));
-    details::check(mWritePtr != nullptr);
+        if (status == android::TIMED_OUT) {
+            /*
+             * Attempt the transfer in case a context switch happened outside of
+             * evFlag->waitUntil().
+             */
+            result = transfer();
+            break;
+        }
 
-    if (resetPointers) {
-        mReadPtr->store(0, std::memory_order_release);
-        mWritePtr->store(0, std::memory_order_release);
-    } else if (flavor != kSynchronizedReadWrite) {
-        // Always reset the read pointer.
-        mReadPtr->store(0, std::memory_order_release);
-    }
+        if (status != android::NO_ERROR) {
+            details::logError("Unexpected error code from EventFlag Wait status " + std::to_string(status));
+            break;
+        }
 
-    mRing = reinterpret_cast<uint8_t*>(mapGrantorDescr(Descriptor::DATAPTRPOS));
-    details::check(mRing != nullptr);
+        /*
+         * If there is still insufficient space/data in the FMQ,
+         * keep waiting for another notification.
+         */
+        if (efState & waitNotification) {
+            result = transfer();
+            if (result) {
+                break;
+            }
+        }
+    }
 
-    mEvFlagWord = static_cast<std::atomic<uint32_t>*>(mapGrantorDescr(Descriptor::EVFLAGWORDPOS));
-    if (mEvFlagWord != nullptr) {
-        android::hardware::EventFlag::createEventFlag(mEvFlagWord, &mEventFlag);
+    if (result) {
+        wakeAfterTransfer(isWrite, result, waitNotification, wakeNotification, evFlag);
     }
+
+    return result;
 }
 
 template <typename T, MQFlavor flavor>
-MessageQueue<T, flavor>::MessageQueue(const Descriptor& Desc, bool resetPointers) {
-    mDesc = std::unique_ptr<Descriptor>(new (std::nothrow) Descriptor(Desc));
-    if (mDesc == nullptr) {
-        return;
+template <typename Transfer>
+size_t MessageQueue<T, flavor>::spinTransfer(Transfer transfer, int64_t deadlineNanos) {
+    int64_t budget = mSpinBudgetNanos.load(std::memory_order_relaxed);
+    int64_t minBudget = std::min(mMaxSpinNanos, kMinSpinNanos);
+
+    int64_t startNanos = systemTime(SYSTEM_TIME_MONOTONIC);
+    int64_t spinNanos =
+            deadlineNanos != 0 ? std::min(budget, deadlineNanos - startNanos) : budget;
+    int64_t elapsedNanos = 0;
+    while (elapsedNanos < spinNanos) {
+        for (int i = 0; i < kSpinRelaxCount; i++) {
+            cpuRelax();
+        }
+        size_t result = transfer();
+        elapsedNanos = systemTime(SYSTEM_TIME_MONOTONIC) - startNanos;
+        if (result) {
+            /*
+             * Move the budget halfway towards twice the time it took.
+             */
+            int64_t next = std::max(minBudget, (budget + 2 * elapsedNanos) / 2);
+            mSpinBudgetNanos.store(std::min(mMaxSpinNanos, next), std::memory_order_relaxed);
+            return result;
+        }
     }
 
-    initMemory(resetPointers);
+    mSpinBudgetNanos.store(std::max(minBudget, budget / 2), std::memory_order_relaxed);
+    return 0;
 }
 
 template <typename T, MQFlavor flavor>
-MessageQueue<T, flavor>::MessageQueue(size_t numElementsInQueue, bool configureEventFlagWord) {
-
-    // Check if the buffer size would not overflow size_t
-    if (numElementsInQueue > SIZE_MAX / sizeof(T)) {
+void MessageQueue<T, flavor>::wakeReaders(size_t nMessages,
+                                          uint32_t writeNotification,
+                                          android::hardware::EventFlag* evFlag) {
+    if (writeNotification == 0) {
         return;
     }
+
     /*
-     * The FMQ needs to allocate memory for the ringbuffer as well as for the
-     * read and write pointer counters. If an EventFlag word is to be configured,
-     * we also need to allocate memory for the same/
+     * With read thresholds, the readers are woken up exactly when the one
+     * waiting for the fewest bytes can proceed.
      */
-    size_t kQueueSizeBytes = numElementsInQueue * sizeof(T);
-    size_t kMetaDataSize = 2 * sizeof(android::hardware::RingBufferPosition);
-
-    if (configureEventFlagWord) {
-        kMetaDataSize+= sizeof(std::atomic<uint32_t>);
+    if (mReadThreshold != nullptr) {
+        if (!consumeReadThreshold()) {
+            return;
+        }
+    } else if (mWakePolicyEnabled && evFlag == mEventFlag) {
+        size_t deferredMessages =
+                mDeferredWakeMessages.fetch_add(nMessages, std::memory_order_relaxed) + nMessages;
+        int64_t nowNanos = systemTime(SYSTEM_TIME_MONOTONIC);
+        int64_t deferredSinceNanos = mDeferredSinceNanos.load(std::memory_order_relaxed);
+        bool wake = (mWakePolicy.minMessages != 0 && deferredMessages >= mWakePolicy.minMessages) ||
+                    (mWakePolicy.highWatermark != 0 &&
+                     availableToRead() >= mWakePolicy.highWatermark) ||
+                    (mWakePolicy.minIntervalNanos != 0 &&
+                     nowNanos - mLastWakeNanos.load(std::memory_order_relaxed) >=
+                             mWakePolicy.minIntervalNanos) ||
+                    (deferredSinceNanos != 0 && nowNanos - deferredSinceNanos >= mWakeDelayNanos);
+        if (!wake) {
+            /*
+             * If another writer performs the wake up in the meantime, the
+             * time stored here is stale and the next deferred wake up is
+             * performed early rather than late.
+             */
+            if (mDeferredWakeNotification.fetch_or(writeNotification,
+                                                   std::memory_order_release) == 0) {
+                mDeferredSinceNanos.store(nowNanos, std::memory_order_relaxed);
+                if (mFlushThreadStarted) {
+                    scheduleFlush(nowNanos + mWakeDelayNanos);
+                }
+            }
+            return;
+        }
+        mDeferredWakeMessages.store(0, std::memory_order_relaxed);
+        mDeferredSinceNanos.store(0, std::memory_order_relaxed);
+        mLastWakeNanos.store(nowNanos, std::memory_order_relaxed);
+        writeNotification |= mDeferredWakeNotification.exchange(0, std::memory_order_relaxed);
     }
 
-    /*
-     * Ashmem memory region size needs to be specified in page-aligned bytes.
-     * kQueueSizeBytes needs to be aligned to word boundary so that all offsets
-     * in the grantorDescriptor will be word aligned.
-     */
-    size_t kAshmemSizePageAligned =
-            (Descriptor::alignToWordBoundary(kQueueSizeBytes) + kMetaDataSize + PAGE_SIZE - 1) &
-            ~(PAGE_SIZE - 1);
+    wakeEventFlag(evFlag, writeNotification, kMultiConsumer, true /* isWrite */);
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::publishReadThreshold(size_t nMessages) {
+    uint64_t threshold = mReadPtr.load(std::memory_order_acquire) + nMessages * sizeof(T);
+
+    uint64_t writePtr = mWritePtr.load(std::memory_order_acquire);
+    uint64_t published = mReadThreshold->load(std::memory_order_relaxed);
+    do {
+        /*
+         * Keep a published threshold which is closer to the write pointer
+         * counter. A threshold which was already reached is at distance 0
+         * or looks farther away than the size of the ring buffer, and is
+         * replaced.
+         */
+        uint64_t remaining = getCounterDistance(published, writePtr);
+        if (published != 0 && remaining != 0 && remaining <= mRingSize &&
+            remaining <= getCounterDistance(threshold, writePtr)) {
+            break;
+        }
+    } while (!mReadThreshold->compare_exchange_weak(published, threshold));
 
     /*
-     * Create an ashmem region to map the memory for the ringbuffer,
-     * read counter and write counter.
+     * Order the publication before the following read of the write pointer
+     * counter, see consumeReadThreshold().
      */
-    int ashmemFd = ashmem_create_region("MessageQueue", kAshmemSizePageAligned);
-    ashmem_set_prot_region(ashmemFd, PROT_READ | PROT_WRITE);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
 
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::consumeReadThreshold() {
     /*
-     * The native handle will contain the fds to be mapped.
+     * Order the update of the write pointer counter before the read of the
+     * threshold, see publishReadThreshold().
      */
-    native_handle_t* mqHandle =
-            native_handle_create(1 /* numFds */, 0 /* numInts */);
-    if (mqHandle == nullptr) {
-        return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t threshold = mReadThreshold->load(std::memory_order_relaxed);
+    if (threshold == 0) {
+        return true;
     }
 
-    mqHandle->data[0] = ashmemFd;
-    mDesc = std::unique_ptr<Descriptor>(new (std::nothrow) Descriptor(kQueueSizeBytes,
-                                                                      mqHandle,
-                                                                      sizeof(T),
-                                                                      configureEventFlagWord));
-    if (mDesc == nullptr) {
-        return;
+    uint64_t remaining = getCounterDistance(threshold, mWritePtr.load(std::memory_order_relaxed));
+    if (remaining != 0 && remaining <= mRingSize) {
+        return false;
     }
-    initMemory(true);
+
+    /*
+     * If a reader replaced the threshold in the meantime, the readers are
+     * woken up anyway and the ones which cannot proceed publish again.
+     */
+    mReadThreshold->compare_exchange_strong(threshold, 0);
+    return true;
 }
 
 template <typename T, MQFlavor flavor>
-MessageQueue<T, flavor>::~MessageQueue() {
-    if (flavor == kUnsynchronizedWrite) {
-        delete mReadPtr;
+bool MessageQueue<T, flavor>::setWakePolicy(const MQWakePolicy& policy) {
+    bool enabled =
+            policy.minMessages != 0 || policy.highWatermark != 0 || policy.minIntervalNanos != 0;
+    if (!kSynchronizedWrite && policy.highWatermark != 0) {
+        details::logError("A wake policy high watermark requires a synchronized flavor");
+        return false;
+    }
+    if (enabled && mReadThreshold != nullptr) {
+        details::logError("Wake policies are not supported with read wake thresholds");
+        return false;
+    }
+    if (enabled && (policy.maxDelayNanos < 0 || (policy.maxDelayNanos != 0 &&
+                                                 policy.maxDelayNanos < policy.minIntervalNanos))) {
+        details::logError("A wake policy maxDelayNanos must not be negative nor shorter than "
+                          "its minIntervalNanos");
+        return false;
+    }
+    if (enabled && policy.flushThread) {
+        if (!mFlushThreadStarted && !startFlushThread()) {
+            return false;
+        }
     } else {
-        unmapGrantorDescr(mReadPtr, Descriptor::READPTRPOS);
+        stopFlushThread();
     }
-    if (mWritePtr != nullptr) {
-        unmapGrantorDescr(mWritePtr, Descriptor::WRITEPTRPOS);
+    mWakePolicy = policy;
+    mWakePolicyEnabled = enabled;
+    mWakeDelayNanos = policy.maxDelayNanos != 0      ? policy.maxDelayNanos
+                      : policy.minIntervalNanos != 0 ? policy.minIntervalNanos
+                                                     : 1000000;
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::startFlushThread() {
+    int error = pthread_create(
+            &mFlushThread, nullptr,
+            [](void* queue) -> void* {
+                static_cast<MessageQueue<T, flavor>*>(queue)->runFlushThread();
+                return nullptr;
+            },
+            this);
+    if (error != 0) {
+        details::logError(std::string("Failed to start the FMQ flush thread: ") +
+                          strerror(error));
+        return false;
     }
-    if (mRing != nullptr) {
-        unmapGrantorDescr(mRing, Descriptor::DATAPTRPOS);
+    mFlushThreadStarted = true;
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::stopFlushThread() {
+    if (!mFlushThreadStarted) {
+        return;
     }
-    if (mEvFlagWord != nullptr) {
-        unmapGrantorDescr(mEvFlagWord, Descriptor::EVFLAGWORDPOS);
-        android::hardware::EventFlag::deleteEventFlag(&mEventFlag);
+    {
+        std::lock_guard<std::mutex> lock(mFlushMutex);
+        mFlushThreadExit = true;
     }
+    mFlushCondition.notify_one();
+    pthread_join(mFlushThread, nullptr);
+    mFlushThreadStarted = false;
+    mFlushThreadExit = false;
+    mFlushDeadlineNanos = 0;
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::write(const T* data) {
-    return write(data, 1);
+void MessageQueue<T, flavor>::scheduleFlush(int64_t deadlineNanos) {
+    std::lock_guard<std::mutex> lock(mFlushMutex);
+    /*
+     * A deadline which is already scheduled is kept, even though the wake up
+     * it was scheduled for may have been performed since: the deferred wake
+     * up is then performed early rather than late.
+     */
+    if (mFlushDeadlineNanos == 0) {
+        mFlushDeadlineNanos = deadlineNanos;
+        mFlushCondition.notify_one();
+    }
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::read(T* data) {
-    return read(data, 1);
+void MessageQueue<T, flavor>::runFlushThread() {
+    std::unique_lock<std::mutex> lock(mFlushMutex);
+    while (!mFlushThreadExit) {
+        if (mFlushDeadlineNanos == 0) {
+            mFlushCondition.wait(lock);
+            continue;
+        }
+        int64_t nowNanos = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (nowNanos < mFlushDeadlineNanos) {
+            mFlushCondition.wait_for(lock,
+                                     std::chrono::nanoseconds(mFlushDeadlineNanos - nowNanos));
+            continue;
+        }
+        mFlushDeadlineNanos = 0;
+        lock.unlock();
+        flushNotifications();
+        lock.lock();
+    }
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::write(const T* data, size_t nMessages) {
-    MemTransaction tx;
-    return beginWrite(nMessages, &tx) &&
-            tx.copyTo(data, 0 /* startIdx */, nMessages) &&
-            commitWrite(nMessages);
+void MessageQueue<T, flavor>::flushNotifications() {
+    uint32_t writeNotification = mDeferredWakeNotification.exchange(0, std::memory_order_acquire);
+    if (writeNotification == 0) {
+        return;
+    }
+    mDeferredWakeMessages.store(0, std::memory_order_relaxed);
+    mDeferredSinceNanos.store(0, std::memory_order_relaxed);
+    /*
+     * The flush thread calls this as well, so the policy, which may have
+     * been changed since, is not read.
+     */
+    mLastWakeNanos.store(systemTime(SYSTEM_TIME_MONOTONIC), std::memory_order_relaxed);
+
+    wakeEventFlag(mEventFlag, writeNotification, kMultiConsumer, true /* isWrite */);
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::wakeAfterTransfer(bool isWrite,
+                                                size_t nMessages,
+                                                uint32_t waitNotification,
+                                                uint32_t wakeNotification,
+                                                android::hardware::EventFlag* evFlag) {
+    bool selfCompete = isWrite ? kMultiProducer : kMultiConsumer;
+
+    if (isWrite) {
+        wakeReaders(nMessages, wakeNotification, evFlag);
+    } else if (wakeNotification != 0) {
+        wakeEventFlag(evFlag, wakeNotification, kMultiProducer, isWrite);
+    }
+
+    if (selfCompete &&
+        (isWrite ? availableToWriteBytes() : availableToReadBytes()) >= sizeof(T)) {
+        wakeEventFlag(evFlag, waitNotification, true /* wakeOne */, isWrite);
+    }
 }
 
 template <typename T, MQFlavor flavor>
@@ -729,6 +3259,17 @@ bool MessageQueue<T, flavor>::writeBlocking(const T* data,
                                             uint32_t writeNotification,
                                             int64_t timeOutNanos,
                                             android::hardware::EventFlag* evFlag) {
+    return writeBlockingUntil(data, count, readNotification, writeNotification,
+                              deadlineFromTimeout(timeOutNanos), evFlag);
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::writeBlockingUntil(const T* data,
+                                                 size_t count,
+                                                 uint32_t readNotification,
+                                                 uint32_t writeNotification,
+                                                 int64_t deadlineNanos,
+                                                 android::hardware::EventFlag* evFlag) {
     /*
      * If evFlag is null and the FMQ does not have its own EventFlag object
      * return false;
@@ -744,7 +3285,7 @@ bool MessageQueue<T, flavor>::writeBlocking(const T* data,
         }
     }
 
-    if ((readNotification == 0 && flavor == kSynchronizedReadWrite) ||
+    if ((readNotification == 0 && kSynchronizedWrite) ||
         (count > getQuantumCount())) {
         return false;
     }
@@ -760,84 +3301,71 @@ bool MessageQueue<T, flavor>::writeBlocking(const T* data,
      * by a wait() call, however the bit would be correctly cleared by the next
      * blockingWrite() call.
      */
+    return transferBlocking(
+            [this, data, count]() -> size_t { return write(data, count) ? count : 0; },
+            true /* isWrite */, count, readNotification, writeNotification,
+            deadlineNanos, evFlag) != 0;
+}
 
-    bool result = write(data, count);
-    if (result) {
-        if (writeNotification) {
-            evFlag->wake(writeNotification);
-        }
-        return result;
-    }
-
-    bool shouldTimeOut = timeOutNanos != 0;
-    int64_t prevTimeNanos = shouldTimeOut ? android::elapsedRealtimeNano() : 0;
-
-    while (true) {
-        /* It is not required to adjust 'timeOutNanos' if 'shouldTimeOut' is false */
-        if (shouldTimeOut) {
-            /*
-             * The current time and 'prevTimeNanos' are both CLOCK_BOOTTIME clock values(converted
-             * to Nanoseconds)
-             */
-            int64_t currentTimeNs = android::elapsedRealtimeNano();
-            /*
-             * Decrement 'timeOutNanos' to account for the time taken to complete the last
-             * iteration of the while loop.
-             */
-            timeOutNanos -= currentTimeNs - prevTimeNanos;
-            prevTimeNanos = currentTimeNs;
-
-            if (timeOutNanos <= 0) {
-                /*
-                 * Attempt write in case a context switch happened outside of
-                 * evFlag->wait().
-                 */
-                result = write(data, count);
-                break;
-            }
-        }
-
-        /*
-         * wait() will return immediately if there was a pending read
-         * notification.
-         */
-        uint32_t efState = 0;
-        status_t status = evFlag->wait(readNotification,
-                                       &efState,
-                                       timeOutNanos,
-                                       true /* retry on spurious wake */);
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::writeBlocking(const T* data,
+                   size_t count,
+                   int64_t timeOutNanos) {
+    return writeBlocking(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+}
 
-        if (status != android::TIMED_OUT && status != android::NO_ERROR) {
-            details::logError("Unexpected error code from EventFlag Wait status " + std::to_string(status));
-            break;
-        }
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::writeBlockingUntil(const T* data, size_t count,
+                                                 int64_t deadlineNanos) {
+    return writeBlockingUntil(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, deadlineNanos);
+}
 
-        if (status == android::TIMED_OUT) {
-            break;
-        }
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::writeUpToBlocking(const T* data,
+                                                  size_t maxMessages,
+                                                  uint32_t readNotification,
+                                                  uint32_t writeNotification,
+                                                  int64_t timeOutNanos,
+                                                  android::hardware::EventFlag* evFlag) {
+    return writeUpToBlockingUntil(data, maxMessages, readNotification, writeNotification,
+                                  deadlineFromTimeout(timeOutNanos), evFlag);
+}
 
-        /*
-         * If there is still insufficient space to write to the FMQ,
-         * keep waiting for another readNotification.
-         */
-        if ((efState & readNotification) && write(data, count)) {
-            result = true;
-            break;
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::writeUpToBlockingUntil(const T* data,
+                                                       size_t maxMessages,
+                                                       uint32_t readNotification,
+                                                       uint32_t writeNotification,
+                                                       int64_t deadlineNanos,
+                                                       android::hardware::EventFlag* evFlag) {
+    if (evFlag == nullptr) {
+        evFlag = mEventFlag;
+        if (evFlag == nullptr) {
+            return 0;
         }
     }
 
-    if (result && writeNotification != 0) {
-        evFlag->wake(writeNotification);
+    if ((readNotification == 0 && kSynchronizedWrite) || maxMessages == 0) {
+        return 0;
     }
 
-    return result;
+    return transferBlocking(
+            [this, data, maxMessages]() { return writeUpTo(data, maxMessages); },
+            true /* isWrite */, 1 /* minMessages */, readNotification, writeNotification,
+            deadlineNanos, evFlag);
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::writeBlocking(const T* data,
-                   size_t count,
-                   int64_t timeOutNanos) {
-    return writeBlocking(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+size_t MessageQueue<T, flavor>::writeUpToBlocking(const T* data, size_t maxMessages,
+                                                  int64_t timeOutNanos) {
+    return writeUpToBlocking(data, maxMessages, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+}
+
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::writeUpToBlockingUntil(const T* data, size_t maxMessages,
+                                                       int64_t deadlineNanos) {
+    return writeUpToBlockingUntil(data, maxMessages, FMQ_NOT_FULL, FMQ_NOT_EMPTY,
+                                  deadlineNanos);
 }
 
 template <typename T, MQFlavor flavor>
@@ -847,6 +3375,17 @@ bool MessageQueue<T, flavor>::readBlocking(T* data,
                                            uint32_t writeNotification,
                                            int64_t timeOutNanos,
                                            android::hardware::EventFlag* evFlag) {
+    return readBlockingUntil(data, count, readNotification, writeNotification,
+                             deadlineFromTimeout(timeOutNanos), evFlag);
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::readBlockingUntil(T* data,
+                                                size_t count,
+                                                uint32_t readNotification,
+                                                uint32_t writeNotification,
+                                                int64_t deadlineNanos,
+                                                android::hardware::EventFlag* evFlag) {
     /*
      * If evFlag is null and the FMQ does not own its own EventFlag object
      * return false;
@@ -875,86 +3414,72 @@ bool MessageQueue<T, flavor>::readBlocking(T* data,
      * by a wait() call, however the bit would be correctly cleared by the next
      * readBlocking() call.
      */
+    return transferBlocking(
+            [this, data, count]() -> size_t { return read(data, count) ? count : 0; },
+            false /* isWrite */, count, writeNotification, readNotification,
+            deadlineNanos, evFlag) != 0;
+}
 
-    bool result = read(data, count);
-    if (result) {
-        if (readNotification) {
-            evFlag->wake(readNotification);
-        }
-        return result;
-    }
-
-    bool shouldTimeOut = timeOutNanos != 0;
-    int64_t prevTimeNanos = shouldTimeOut ? android::elapsedRealtimeNano() : 0;
-
-    while (true) {
-        /* It is not required to adjust 'timeOutNanos' if 'shouldTimeOut' is false */
-        if (shouldTimeOut) {
-            /*
-             * The current time and 'prevTimeNanos' are both CLOCK_BOOTTIME clock values(converted
-             * to Nanoseconds)
-             */
-            int64_t currentTimeNs = android::elapsedRealtimeNano();
-            /*
-             * Decrement 'timeOutNanos' to account for the time taken to complete the last
-             * iteration of the while loop.
-             */
-            timeOutNanos -= currentTimeNs - prevTimeNanos;
-            prevTimeNanos = currentTimeNs;
-
-            if (timeOutNanos <= 0) {
-                /*
-                 * Attempt read in case a context switch happened outside of
-                 * evFlag->wait().
-                 */
-                result = read(data, count);
-                break;
-            }
-        }
-
-        /*
-         * wait() will return immediately if there was a pending write
-         * notification.
-         */
-        uint32_t efState = 0;
-        status_t status = evFlag->wait(writeNotification,
-                                       &efState,
-                                       timeOutNanos,
-                                       true /* retry on spurious wake */);
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::readBlocking(T* data, size_t count, int64_t timeOutNanos) {
+    return readBlocking(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+}
 
-        if (status != android::TIMED_OUT && status != android::NO_ERROR) {
-            details::logError("Unexpected error code from EventFlag Wait status " + std::to_string(status));
-            break;
-        }
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::readBlockingUntil(T* data, size_t count, int64_t deadlineNanos) {
+    return readBlockingUntil(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, deadlineNanos);
+}
 
-        if (status == android::TIMED_OUT) {
-            break;
-        }
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::readUpToBlocking(T* data,
+                                                 size_t maxMessages,
+                                                 uint32_t readNotification,
+                                                 uint32_t writeNotification,
+                                                 int64_t timeOutNanos,
+                                                 android::hardware::EventFlag* evFlag) {
+    return readUpToBlockingUntil(data, maxMessages, readNotification, writeNotification,
+                                 deadlineFromTimeout(timeOutNanos), evFlag);
+}
 
-        /*
-         * If the data in FMQ is still insufficient, go back to waiting
-         * for another write notification.
-         */
-        if ((efState & writeNotification) && read(data, count)) {
-            result = true;
-            break;
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::readUpToBlockingUntil(T* data,
+                                                      size_t maxMessages,
+                                                      uint32_t readNotification,
+                                                      uint32_t writeNotification,
+                                                      int64_t deadlineNanos,
+                                                      android::hardware::EventFlag* evFlag) {
+    if (evFlag == nullptr) {
+        evFlag = mEventFlag;
+        if (evFlag == nullptr) {
+            return 0;
         }
     }
 
-    if (result && readNotification != 0) {
-        evFlag->wake(readNotification);
+    if (writeNotification == 0 || maxMessages == 0) {
+        return 0;
     }
-    return result;
+
+    return transferBlocking(
+            [this, data, maxMessages]() { return readUpTo(data, maxMessages); },
+            false /* isWrite */, 1 /* minMessages */, writeNotification, readNotification,
+            deadlineNanos, evFlag);
 }
 
 template <typename T, MQFlavor flavor>
-bool MessageQueue<T, flavor>::readBlocking(T* data, size_t count, int64_t timeOutNanos) {
-    return readBlocking(data, count, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+size_t MessageQueue<T, flavor>::readUpToBlocking(T* data, size_t maxMessages,
+                                                 int64_t timeOutNanos) {
+    return readUpToBlocking(data, maxMessages, FMQ_NOT_FULL, FMQ_NOT_EMPTY, timeOutNanos);
+}
+
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::readUpToBlockingUntil(T* data, size_t maxMessages,
+                                                      int64_t deadlineNanos) {
+    return readUpToBlockingUntil(data, maxMessages, FMQ_NOT_FULL, FMQ_NOT_EMPTY, deadlineNanos);
 }
 
 template <typename T, MQFlavor flavor>
 size_t MessageQueue<T, flavor>::availableToWriteBytes() const {
-    return mDesc->getSize() - availableToReadBytes();
+    return mRingSize - availableToReadBytes();
 }
 
 template <typename T, MQFlavor flavor>
@@ -969,45 +3494,140 @@ size_t MessageQueue<T, flavor>::availableToRead() const {
 
 template <typename T, MQFlavor flavor>
 bool MessageQueue<T, flavor>::beginWrite(size_t nMessages, MemTransaction* result) const {
+    if (!reserveWrite(nMessages, result)) {
+        return false;
+    }
+    if (kMultiProducer) {
+        mLastWritePtr = result->position;
+    }
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+bool MessageQueue<T, flavor>::reserveWrite(size_t nMessages, MemTransaction* result) const {
     /*
      * If nMessages is greater than size of FMQ or in case of the synchronized
-     * FMQ flavor, if there is not enough space to write nMessages, then return
+     * FMQ flavors, if there is not enough space to write nMessages, then return
      * result with null addresses.
      */
-    if ((flavor == kSynchronizedReadWrite && (availableToWrite() < nMessages)) ||
-        nMessages > getQuantumCount()) {
+    uint64_t writePtr;
+    if (!reserveWritePosition(nMessages, &writePtr)) {
         *result = MemTransaction();
         return false;
     }
+    *result = getMemTransaction(writePtr, nMessages);
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+bool MessageQueue<T, flavor>::reserveWritePosition(size_t nMessages, uint64_t* position) const {
+    if (nMessages > getQuantumCount()) {
+        return false;
+    }
+
+    auto writePtr = mWritePtr.load(std::memory_order_relaxed);
+
+    if (kRecycledSlots) {
+        /*
+         * The slots are free once their sequence numbers were handed back by
+         * the readers of the previous items they held. If they are not, the
+         * FMQ is full unless another writer reserved them in the meantime.
+         */
+        size_t nBytesDesired = nMessages * sizeof(T);
+        do {
+            while (countSlotSeqs(writePtr, nMessages, 0 /* seqOffset */) < nMessages) {
+                auto currentWritePtr = mWritePtr.load(std::memory_order_relaxed);
+                if (currentWritePtr == writePtr) {
+                    statsUnavailable(true /* isWrite */);
+                    return false;
+                }
+                writePtr = currentWritePtr;
+            }
+        } while (!mWritePtr.compare_exchange_weak(writePtr, writePtr + nBytesDesired,
+                                                   std::memory_order_relaxed));
+    } else if (kMultiProducer) {
+        /*
+         * Several writers may reserve space concurrently, so the space is
+         * reserved by advancing the write pointer counter with a
+         * compare-and-swap. The cached read pointer counter is not used since
+         * this object may be shared by several writer threads. The items only
+         * become visible to the reader once commitWrite() updates their slot
+         * sequence numbers.
+         */
+        size_t nBytesDesired = nMessages * sizeof(T);
+        do {
+            if (getCounterDistance(writePtr, mReadPtr.load(std::memory_order_acquire)) >
+                mRingSize - nBytesDesired) {
+                statsUnavailable(true /* isWrite */);
+                return false;
+            }
+        } while (!mWritePtr.compare_exchange_weak(writePtr, writePtr + nBytesDesired,
+                                                   std::memory_order_relaxed));
+    } else if (kSynchronizedWrite) {
+        size_t nBytesDesired = nMessages * sizeof(T);
+        /*
+         * The read pointer counter only moves forward, so the cached copy can
+         * only underestimate the available space. It only needs to be
+         * reloaded if it indicates that there is not enough space.
+         */
+        if (getCounterDistance(writePtr, mCachedReadPtr) > mRingSize - nBytesDesired) {
+            mCachedReadPtr = mReadPtr.load(std::memory_order_acquire);
+            if (getCounterDistance(writePtr, mCachedReadPtr) > mRingSize - nBytesDesired) {
+                statsUnavailable(true /* isWrite */);
+                return false;
+            }
+        }
+    }
 
-    auto writePtr = mWritePtr->load(std::memory_order_relaxed);
-    size_t writeOffset = writePtr % mDesc->getSize();
+    if (mWritePrefetchDistance != 0) {
+        prefetchRing(writePtr, nMessages * sizeof(T), mWritePrefetchDistance, true /* forWrite */);
+    }
+    *position = writePtr;
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+typename MessageQueue<T, flavor>::MemTransaction MessageQueue<T, flavor>::getMemTransaction(
+        uint64_t position, size_t nMessages) const {
+    size_t offset = getRingOffset(position);
 
     /*
-     * From writeOffset, the number of messages that can be written
-     * contiguously without wrapping around the ring buffer are calculated.
+     * From offset, the number of messages that can be accessed contiguously
+     * without wrapping around the ring buffer are calculated. With a mirrored
+     * ring buffer, all of them can.
      */
-    size_t contiguousMessages = (mDesc->getSize() - writeOffset) / sizeof(T);
+    size_t contiguousMessages =
+            mRingMirrored ? nMessages : (mRingSize - offset) / sizeof(T);
 
+    MemTransaction result;
     if (contiguousMessages < nMessages) {
         /*
          * Wrap around is required. Both result.first and result.second are
          * populated.
          */
-        *result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + writeOffset),
-                                           contiguousMessages),
-                                 MemRegion(reinterpret_cast<T*>(mRing),
-                                           nMessages - contiguousMessages));
+        result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + offset),
+                                          contiguousMessages),
+                                MemRegion(reinterpret_cast<T*>(mRing),
+                                          nMessages - contiguousMessages));
     } else {
         /*
-         * A wrap around is not required to write nMessages. Only result.first
-         * is populated.
+         * A wrap around is not required. Only result.first is populated.
          */
-        *result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + writeOffset), nMessages),
-                                 MemRegion());
+        result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + offset), nMessages),
+                                MemRegion());
     }
-
-    return true;
+    result.position = position;
+    return result;
 }
 
 template <typename T, MQFlavor flavor>
@@ -1017,10 +3637,17 @@ template <typename T, MQFlavor flavor>
  */
 __attribute__((no_sanitize("integer")))
 bool MessageQueue<T, flavor>::commitWrite(size_t nMessages) {
+    if (kMultiProducer) {
+        storeSlotSeqs(mLastWritePtr, nMessages, 1 /* seqOffset */);
+        statsTransfer(true /* isWrite */, nMessages);
+        return true;
+    }
+
     size_t nBytesWritten = nMessages * sizeof(T);
-    auto writePtr = mWritePtr->load(std::memory_order_relaxed);
+    auto writePtr = mWritePtr.load(std::memory_order_relaxed);
     writePtr += nBytesWritten;
-    mWritePtr->store(writePtr, std::memory_order_release);
+    mWritePtr.store(writePtr, std::memory_order_release);
+    statsTransfer(true /* isWrite */, nMessages);
     /*
      * This method cannot fail now since we are only incrementing the writePtr
      * counter.
@@ -1028,6 +3655,51 @@ bool MessageQueue<T, flavor>::commitWrite(size_t nMessages) {
     return true;
 }
 
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::commitWrite(const MemTransaction& memTx) {
+    size_t nMessages = memTx.getFirstRegion().getLength() + memTx.getSecondRegion().getLength();
+    if (kMultiProducer) {
+        storeSlotSeqs(memTx.position, nMessages, 1 /* seqOffset */);
+        statsTransfer(true /* isWrite */, nMessages);
+        return true;
+    }
+    return commitWrite(nMessages);
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::storeSlotSeqs(uint64_t position, size_t nMessages,
+                                            uint64_t seqOffset) {
+    /*
+     * The sequence numbers are stored with release semantics and loaded with
+     * acquire semantics, so that the reader sees the items once they are
+     * committed and the writer does not overwrite them before they are read.
+     */
+    uint64_t seq = position / sizeof(T) + seqOffset;
+    size_t slot = getRingOffset(position) / sizeof(T);
+    for (size_t i = 0; i < nMessages; i++) {
+        mSlotSeq[slot].store(static_cast<uint32_t>(seq + i), std::memory_order_release);
+        if (++slot == mQuantumCount) {
+            slot = 0;
+        }
+    }
+}
+
+template <typename T, MQFlavor flavor>
+size_t MessageQueue<T, flavor>::countSlotSeqs(uint64_t position, size_t nMessages,
+                                              uint64_t seqOffset) const {
+    uint64_t seq = position / sizeof(T) + seqOffset;
+    size_t slot = getRingOffset(position) / sizeof(T);
+    for (size_t i = 0; i < nMessages; i++) {
+        if (mSlotSeq[slot].load(std::memory_order_acquire) != static_cast<uint32_t>(seq + i)) {
+            return i;
+        }
+        if (++slot == mQuantumCount) {
+            slot = 0;
+        }
+    }
+    return nMessages;
+}
+
 template <typename T, MQFlavor flavor>
 size_t MessageQueue<T, flavor>::availableToReadBytes() const {
     /*
@@ -1035,15 +3707,29 @@ size_t MessageQueue<T, flavor>::availableToReadBytes() const {
      * hence requries a memory_order_acquired load for both mReadPtr and
      * mWritePtr.
      */
-    return mWritePtr->load(std::memory_order_acquire) -
-            mReadPtr->load(std::memory_order_acquire);
+    return getCounterDistance(mWritePtr.load(std::memory_order_acquire),
+                              mReadPtr.load(std::memory_order_acquire));
 }
 
 template <typename T, MQFlavor flavor>
 bool MessageQueue<T, flavor>::read(T* data, size_t nMessages) {
     MemTransaction tx;
+    if (kMultiConsumer) {
+        /*
+         * The items are copied out before they are claimed. If another reader
+         * claimed them first, the copy is discarded and the read is retried
+         * with the next items.
+         */
+        while (prepareRead(nMessages, &tx) &&
+               tx.copyFrom(data, 0 /* startIdx */, nMessages, mReadCopyPolicy)) {
+            if (commitRead(tx)) {
+                return true;
+            }
+        }
+        return false;
+    }
     return beginRead(nMessages, &tx) &&
-            tx.copyFrom(data, 0 /* startIdx */, nMessages) &&
+            tx.copyFrom(data, 0 /* startIdx */, nMessages, mReadCopyPolicy) &&
             commitRead(nMessages);
 }
 
@@ -1053,63 +3739,229 @@ template <typename T, MQFlavor flavor>
  * and legal.
  */
 __attribute__((no_sanitize("integer")))
-bool MessageQueue<T, flavor>::beginRead(size_t nMessages, MemTransaction* result) const {
-    *result = MemTransaction();
+size_t MessageQueue<T, flavor>::readUpTo(T* data, size_t maxMessages) {
+    if (kMultiConsumer) {
+        /*
+         * Other readers may claim items between the computation of the number
+         * of available items and the read. Retry with what is left.
+         */
+        while (true) {
+            size_t nMessages = std::min(maxMessages, getQuantumCount());
+            /*
+             * With kRecycledSlots, the committed items are counted from the
+             * slot sequence numbers instead of the write pointer counter.
+             */
+            if (kRecycledSlots) {
+                nMessages = countSlotSeqs(mReadPtr.load(std::memory_order_relaxed), nMessages,
+                                          1 /* seqOffset */);
+            } else {
+                nMessages = std::min(availableToReadBytes() / sizeof(T), nMessages);
+            }
+            if (nMessages == 0) {
+                statsUnavailable(false /* isWrite */);
+                return 0;
+            }
+            if (read(data, nMessages)) {
+                return nMessages;
+            }
+        }
+    }
+
+    auto readPtr = mReadPtr.load(std::memory_order_relaxed);
+    size_t nBytesDesired = std::min(maxMessages, getQuantumCount()) * sizeof(T);
+
     /*
-     * If it is detected that the data in the queue was overwritten
-     * due to the reader process being too slow, the read pointer counter
-     * is set to the same as the write pointer counter to indicate error
-     * and the read returns false;
-     * Need acquire/release memory ordering for mWritePtr.
+     * Only reload the write pointer counter if the cached copy indicates
+     * that less than 'maxMessages' items are available.
      */
-    auto writePtr = mWritePtr->load(std::memory_order_acquire);
+    auto writePtr = mCachedWritePtr;
+    if (getCounterDistance(writePtr, readPtr) < nBytesDesired ||
+        getCounterDistance(writePtr, readPtr) > mRingSize) {
+        writePtr = mWritePtr.load(std::memory_order_acquire);
+        mCachedWritePtr = writePtr;
+    }
+
     /*
-     * A relaxed load is sufficient for mReadPtr since there will be no
-     * stores to mReadPtr from a different thread.
+     * If the FMQ overflowed, attempt to read a single item so that
+     * beginRead() handles the overflow.
+     */
+    size_t nMessages = getCounterDistance(writePtr, readPtr) > mRingSize
+            ? 1
+            : std::min<size_t>(nBytesDesired, getCounterDistance(writePtr, readPtr)) / sizeof(T);
+
+    /*
+     * With several writers, only read up to the first item which has been
+     * reserved but not committed yet.
      */
-    auto readPtr = mReadPtr->load(std::memory_order_relaxed);
+    if (kMultiProducer) {
+        nMessages = countSlotSeqs(readPtr, nMessages, 1 /* seqOffset */);
+    }
+
+    if (nMessages == 0) {
+        statsUnavailable(false /* isWrite */);
+        return 0;
+    }
+    if (!read(data, nMessages)) {
+        return 0;
+    }
+    return nMessages;
+}
 
-    if (writePtr - readPtr > mDesc->getSize()) {
-        mReadPtr->store(writePtr, std::memory_order_release);
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+bool MessageQueue<T, flavor>::beginRead(size_t nMessages, MemTransaction* result) const {
+    if (!prepareRead(nMessages, result)) {
         return false;
     }
+    if (kMultiConsumer) {
+        mLastReadPtr = result->position;
+    }
+    return true;
+}
 
-    size_t nBytesDesired = nMessages * sizeof(T);
-    /*
-     * Return if insufficient data to read in FMQ.
-     */
-    if (writePtr - readPtr < nBytesDesired) {
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+bool MessageQueue<T, flavor>::prepareRead(size_t nMessages, MemTransaction* result) const {
+    uint64_t readPtr;
+    if (!prepareReadPosition(nMessages, &readPtr)) {
+        *result = MemTransaction();
         return false;
     }
+    *result = getMemTransaction(readPtr, nMessages);
+    return true;
+}
 
-    size_t readOffset = readPtr % mDesc->getSize();
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+bool MessageQueue<T, flavor>::prepareReadPosition(size_t nMessages, uint64_t* position) const {
+    /*
+     * If it is detected that the data in the queue was overwritten
+     * due to the reader process being too slow, the read pointer counter
+     * is moved to the position selected by setOverflowReadPosition() (by
+     * default the write pointer counter) and the read returns false;
+     * Need acquire/release memory ordering for mWritePtr.
+     */
     /*
-     * From readOffset, the number of messages that can be read contiguously
-     * without wrapping around the ring buffer are calculated.
+     * A relaxed load is sufficient for mReadPtr since there will be no
+     * stores to mReadPtr from a different thread, except for the
+     * multi-consumer flavors, whose readers only claim items with a
+     * compare-and-swap in commitRead().
      */
-    size_t contiguousMessages = (mDesc->getSize() - readOffset) / sizeof(T);
+    auto readPtr = mReadPtr.load(std::memory_order_relaxed);
+    size_t nBytesDesired = nMessages * sizeof(T);
 
-    if (contiguousMessages < nMessages) {
+    if (kRecycledSlots) {
         /*
-         * A wrap around is required. Both result.first and result.second
-         * are populated.
+         * The items are available once the writers committed them. If they
+         * are not, there is not enough data unless another reader claimed
+         * them in the meantime.
          */
-        *result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + readOffset),
-                                           contiguousMessages),
-                                 MemRegion(reinterpret_cast<T*>(mRing),
-                                           nMessages - contiguousMessages));
+        if (nMessages > getQuantumCount()) {
+            return false;
+        }
+        while (countSlotSeqs(readPtr, nMessages, 1 /* seqOffset */) < nMessages) {
+            auto currentReadPtr = mReadPtr.load(std::memory_order_relaxed);
+            if (currentReadPtr == readPtr) {
+                statsUnavailable(false /* isWrite */);
+                return false;
+            }
+            readPtr = currentReadPtr;
+        }
     } else {
         /*
-         * A wrap around is not required. Only result.first need to be
-         * populated.
+         * The write pointer counter only moves forward, so the cached copy
+         * can only underestimate the amount of data available. It was
+         * obtained with an acquire load, hence all the data up to it is
+         * visible. It only needs to be reloaded if it indicates that there is
+         * not enough data, or if it is behind the read pointer counter (e.g.
+         * because the read pointer counter was moved after an overflow). The
+         * cached copy is not used by the multi-consumer flavors since this
+         * object may be shared by several reader threads.
+         */
+        uint64_t writePtr;
+        if (kMultiConsumer) {
+            writePtr = mWritePtr.load(std::memory_order_acquire);
+        } else {
+            writePtr = mCachedWritePtr;
+            if (getCounterDistance(writePtr, readPtr) < nBytesDesired ||
+                getCounterDistance(writePtr, readPtr) > mRingSize) {
+                writePtr = mWritePtr.load(std::memory_order_acquire);
+                mCachedWritePtr = writePtr;
+            }
+        }
+
+        if (getCounterDistance(writePtr, readPtr) > mRingSize) {
+            handleReadOverflow(readPtr, writePtr);
+            return false;
+        }
+
+        /*
+         * Return if insufficient data to read in FMQ.
+         */
+        if (getCounterDistance(writePtr, readPtr) < nBytesDesired) {
+            statsUnavailable(false /* isWrite */);
+            return false;
+        }
+
+        /*
+         * With several writers, the write pointer counter also covers items
+         * which were reserved but not committed yet.
          */
-        *result = MemTransaction(MemRegion(reinterpret_cast<T*>(mRing + readOffset), nMessages),
-                                 MemRegion());
+        if (kMultiProducer && countSlotSeqs(readPtr, nMessages, 1 /* seqOffset */) < nMessages) {
+            statsUnavailable(false /* isWrite */);
+            return false;
+        }
     }
 
+    if (mReadPrefetchDistance != 0) {
+        prefetchRing(readPtr, nBytesDesired, mReadPrefetchDistance, false /* forWrite */);
+    }
+    *position = readPtr;
     return true;
 }
 
+template <typename T, MQFlavor flavor>
+/*
+ * Disable integer sanitization since integer overflow here is allowed
+ * and legal.
+ */
+__attribute__((no_sanitize("integer")))
+void MessageQueue<T, flavor>::prefetchRing(uint64_t position, size_t nBytes, size_t distance,
+                                           bool forWrite) const {
+    /*
+     * The prefetch window moves from [position, position + distance) to
+     * [position + nBytes, position + nBytes + distance).
+     */
+    size_t offset = getRingOffset(position + std::max(distance, nBytes));
+    size_t length = std::min(distance, nBytes);
+
+    length += offset % kPrefetchLineSize;
+    offset -= offset % kPrefetchLineSize;
+    for (size_t i = 0; i < length; i += kPrefetchLineSize) {
+        if (forWrite) {
+            __builtin_prefetch(mRing + offset, 1 /* write */, 3 /* keep in all levels */);
+        } else {
+            __builtin_prefetch(mRing + offset, 0 /* read */, 3 /* keep in all levels */);
+        }
+        offset += kPrefetchLineSize;
+        if (offset >= mRingSize) {
+            offset = 0;
+        }
+    }
+}
+
 template <typename T, MQFlavor flavor>
 /*
  * Disable integer sanitization since integer overflow here is allowed
@@ -1117,21 +3969,63 @@ template <typename T, MQFlavor flavor>
  */
 __attribute__((no_sanitize("integer")))
 bool MessageQueue<T, flavor>::commitRead(size_t nMessages) {
+    if (kMultiConsumer) {
+        return claimRead(mLastReadPtr, nMessages);
+    }
+
     // TODO: Use a local copy of readPtr to avoid relazed mReadPtr loads.
-    auto readPtr = mReadPtr->load(std::memory_order_relaxed);
-    auto writePtr = mWritePtr->load(std::memory_order_acquire);
+    auto readPtr = mReadPtr.load(std::memory_order_relaxed);
     /*
      * If the flavor is unsynchronized, it is possible that a write overflow may
-     * have occured between beginRead() and commitRead().
+     * have occured between beginRead() and commitRead(). The writer of a
+     * synchronized FMQ cannot overwrite unread data, so the write pointer
+     * counter does not need to be loaded in that case.
      */
-    if (writePtr - readPtr > mDesc->getSize()) {
-        mReadPtr->store(writePtr, std::memory_order_release);
-        return false;
+    if (!kSynchronizedWrite) {
+        auto writePtr = mWritePtr.load(std::memory_order_acquire);
+        mCachedWritePtr = writePtr;
+        if (getCounterDistance(writePtr, readPtr) > mRingSize) {
+            handleReadOverflow(readPtr, writePtr);
+            return false;
+        }
     }
 
     size_t nBytesRead = nMessages * sizeof(T);
     readPtr += nBytesRead;
-    mReadPtr->store(readPtr, std::memory_order_release);
+    mReadPtr.store(readPtr, std::memory_order_release);
+    statsTransfer(false /* isWrite */, nMessages);
+    return true;
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::commitRead(const MemTransaction& memTx) {
+    size_t nMessages = memTx.getFirstRegion().getLength() + memTx.getSecondRegion().getLength();
+    if (kMultiConsumer) {
+        return claimRead(memTx.position, nMessages);
+    }
+    return commitRead(nMessages);
+}
+
+template <typename T, MQFlavor flavor>
+bool MessageQueue<T, flavor>::claimRead(uint64_t position, size_t nMessages) {
+    /*
+     * The release semantics order the copy of the items before the claim, so
+     * that the writer does not overwrite them while they are being copied.
+     * The read pointer counter only moves forward, hence the compare-and-swap
+     * fails if any other reader claimed these items.
+     */
+    if (!mReadPtr.compare_exchange_strong(position, position + nMessages * sizeof(T),
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        return false;
+    }
+    /*
+     * Hand the slots back to the writers.
+     */
+    if (kRecycledSlots) {
+        storeSlotSeqs(position, nMessages, getQuantumCount() /* seqOffset */);
+    }
+    statsTransfer(false /* isWrite */, nMessages);
     return true;
 }
 
@@ -1142,52 +4036,175 @@ size_t MessageQueue<T, flavor>::getQuantumSize() const {
 
 template <typename T, MQFlavor flavor>
 size_t MessageQueue<T, flavor>::getQuantumCount() const {
-    return mDesc->getSize() / mDesc->getQuantum();
+    return mQuantumCount;
 }
 
 template <typename T, MQFlavor flavor>
 bool MessageQueue<T, flavor>::isValid() const {
-    return mRing != nullptr && mReadPtr != nullptr && mWritePtr != nullptr;
+    return mRing != nullptr && mReadPtr.isValid() && mWritePtr.isValid() &&
+            (!kMultiProducer || mSlotSeq != nullptr);
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::mapGrantors(bool skipRing) {
+    const native_handle_t* handle = mDesc->handle();
+    auto grantors = mDesc->grantors();
+    if (handle == nullptr) {
+        return;
+    }
+
+    /*
+     * A mirrored ring buffer is mapped on its own and covers whole pages, so
+     * the grantors in front of it and the ones after it (e.g. the statistics
+     * grantor) are mapped separately rather than with a mapping spanning the
+     * ring buffer again.
+     */
+    const auto& ring = grantors[Descriptor::DATAPTRPOS];
+    auto overlapsRing = [&](int fdIndex, size_t start, size_t end) {
+        return skipRing && fdIndex == static_cast<int>(ring.fdIndex) &&
+                start < ring.offset + ring.extent &&
+                end > ring.offset;
+    };
+
+    /*
+     * Grantors which are not configured have a zero extent. Offsets for mmap
+     * must be a multiple of the page size. A hugetlb fd is only mapped and
+     * unmapped in whole huge pages, so both ends of its mappings are rounded
+     * to kHugePageSize; the fd itself was rounded up to it when created.
+     */
+    size_t pageSize = (mMappingFlags & kMQHugePages) ? kHugePageSize : PAGE_SIZE;
+    for (uint32_t grantorIdx = 0; grantorIdx < grantors.size(); grantorIdx++) {
+        if (grantors[grantorIdx].extent == 0 ||
+            (skipRing && grantorIdx == Descriptor::DATAPTRPOS)) {
+            continue;
+        }
+        int fdIndex = grantors[grantorIdx].fdIndex;
+        size_t start = (grantors[grantorIdx].offset / pageSize) * pageSize;
+        size_t end = grantors[grantorIdx].offset + grantors[grantorIdx].extent;
+        if (mMappingFlags & kMQHugePages) {
+            end = (end + pageSize - 1) & ~(pageSize - 1);
+        }
+        auto mapping = std::find_if(
+                mFdMappings.begin(), mFdMappings.end(), [&](const FdMapping& m) {
+                    return m.fdIndex == fdIndex &&
+                            !overlapsRing(fdIndex, std::min(m.offset, start),
+                                          std::max(m.offset + m.length, end));
+                });
+        if (mapping == mFdMappings.end()) {
+            mFdMappings.push_back({fdIndex, start, end - start, nullptr});
+        } else {
+            end = std::max(end, mapping->offset + mapping->length);
+            mapping->offset = std::min(mapping->offset, start);
+            mapping->length = end - mapping->offset;
+        }
+    }
+
+    int mapFlags = MAP_SHARED;
+    if (mMappingFlags & (kMQPrefault | kMQLockMemory)) {
+        mapFlags |= MAP_POPULATE;
+    }
+    for (auto& mapping : mFdMappings) {
+        void* address = mmap(0, mapping.length, PROT_READ | PROT_WRITE, mapFlags,
+                             handle->data[mapping.fdIndex], mapping.offset);
+        if (address == MAP_FAILED) {
+            continue;
+        }
+        mapping.base = reinterpret_cast<uint8_t*>(address);
+        lockMapping(address, mapping.length);
+    }
+}
+
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::unmapGrantors() {
+    for (const auto& mapping : mFdMappings) {
+        if (mapping.base != nullptr) {
+            munmap(mapping.base, mapping.length);
+        }
+    }
+    mFdMappings.clear();
 }
 
 template <typename T, MQFlavor flavor>
-void* MessageQueue<T, flavor>::mapGrantorDescr(uint32_t grantorIdx) {
+void* MessageQueue<T, flavor>::mapGrantorDescr(uint32_t grantorIdx, bool mirrored) {
     const native_handle_t* handle = mDesc->handle();
     auto grantors = mDesc->grantors();
     if ((handle == nullptr) || (grantorIdx >= grantors.size())) {
         return nullptr;
     }
 
-    int fdIndex = grantors[grantorIdx].fdIndex;
     /*
-     * Offset for mmap must be a multiple of PAGE_SIZE.
+     * Grantors which are not configured have a zero extent.
      */
-    int mapOffset = (grantors[grantorIdx].offset / PAGE_SIZE) * PAGE_SIZE;
-    int mapLength =
-            grantors[grantorIdx].offset - mapOffset + grantors[grantorIdx].extent;
+    if (grantors[grantorIdx].extent == 0) {
+        return nullptr;
+    }
+
+    int fdIndex = grantors[grantorIdx].fdIndex;
+
+    if (mirrored) {
+        size_t extent = grantors[grantorIdx].extent;
+        if ((grantors[grantorIdx].offset % PAGE_SIZE) != 0 || (extent % PAGE_SIZE) != 0 ||
+            extent == 0 || extent > SIZE_MAX / 2) {
+            return nullptr;
+        }
+        int mapFlags = MAP_SHARED | MAP_FIXED;
+        if (mMappingFlags & (kMQPrefault | kMQLockMemory)) {
+            mapFlags |= MAP_POPULATE;
+        }
+        /*
+         * Reserve twice the extent of virtual memory and map the grantor over
+         * both halves of the reservation.
+         */
+        void* reservation = mmap(0, 2 * extent, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reservation == MAP_FAILED) {
+            return nullptr;
+        }
+        uint8_t* base = reinterpret_cast<uint8_t*>(reservation);
+        for (size_t i = 0; i < 2; i++) {
+            void* address = mmap(base + i * extent, extent, PROT_READ | PROT_WRITE, mapFlags,
+                                 handle->data[fdIndex], grantors[grantorIdx].offset);
+            if (address == MAP_FAILED) {
+                munmap(reservation, 2 * extent);
+                return nullptr;
+            }
+        }
+        lockMapping(base, 2 * extent);
+        return base;
+    }
+
+    size_t offset = grantors[grantorIdx].offset;
+    for (const auto& mapping : mFdMappings) {
+        if (mapping.fdIndex == fdIndex && mapping.base != nullptr && offset >= mapping.offset &&
+            offset + grantors[grantorIdx].extent <= mapping.offset + mapping.length) {
+            return mapping.base + (offset - mapping.offset);
+        }
+    }
+    return nullptr;
+}
 
-    void* address = mmap(0, mapLength, PROT_READ | PROT_WRITE, MAP_SHARED,
-                         handle->data[fdIndex], mapOffset);
-    return (address == MAP_FAILED)
-            ? nullptr
-            : reinterpret_cast<uint8_t*>(address) +
-            (grantors[grantorIdx].offset - mapOffset);
+template <typename T, MQFlavor flavor>
+void MessageQueue<T, flavor>::lockMapping(void* address, size_t length) {
+    if (!(mMappingFlags & kMQLockMemory)) {
+        return;
+    }
+    /*
+     * The FMQ remains usable without the lock, so the failure is only
+     * reported.
+     */
+    if (mlock(address, length) != 0) {
+        details::logError(std::string("Failed to lock FMQ mapping: ") + strerror(errno));
+        mMemoryLocked = false;
+    }
 }
 
 template <typename T, MQFlavor flavor>
-void MessageQueue<T, flavor>::unmapGrantorDescr(void* address,
-                                                uint32_t grantorIdx) {
+void MessageQueue<T, flavor>::unmapGrantorDescr(void* address, uint32_t grantorIdx) {
     auto grantors = mDesc->grantors();
     if ((address == nullptr) || (grantorIdx >= grantors.size())) {
         return;
     }
 
-    int mapOffset = (grantors[grantorIdx].offset / PAGE_SIZE) * PAGE_SIZE;
-    int mapLength =
-            grantors[grantorIdx].offset - mapOffset + grantors[grantorIdx].extent;
-    void* baseAddress = reinterpret_cast<uint8_t*>(address) -
-            (grantors[grantorIdx].offset - mapOffset);
-    if (baseAddress) munmap(baseAddress, mapLength);
+    munmap(address, 2 * grantors[grantorIdx].extent);
 }
 
 }  // namespace hardware
@@ -16,10 +16,12 @@
 
 #include <asm-generic/mman.h>
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 #include <sstream>
 #include <thread>
+#include <unistd.h>
 #include <fmq/MessageQueue.h>
 #include <fmq/EventFlag.h>
 
@@ -32,6 +34,15 @@ typedef android::hardware::MessageQueue<uint8_t, android::hardware::kSynchronize
           MessageQueueSync;
 typedef android::hardware::MessageQueue<uint8_t, android::hardware::kUnsynchronizedWrite>
             MessageQueueUnsync;
+typedef android::hardware::MessageQueue<uint32_t,
+                                        android::hardware::kMultiProducerSingleConsumer>
+            MessageQueueMpsc;
+typedef android::hardware::MessageQueue<uint32_t,
+                                        android::hardware::kSingleProducerMultiConsumer>
+            MessageQueueSpmc;
+typedef android::hardware::MessageQueue<uint32_t,
+                                        android::hardware::kMultiProducerMultiConsumer>
+            MessageQueueMpmc;
 
 class SynchronizedReadWrites : public ::testing::Test {
 protected:
@@ -122,6 +133,26 @@ protected:
 class BadQueueConfig: public ::testing::Test {
 };
 
+class PowerOfTwoCapacity : public ::testing::Test {
+protected:
+    virtual void TearDown() {
+        delete mQueue;
+    }
+
+    virtual void SetUp() {
+        static constexpr size_t kNumElementsInQueue = 2049;
+        mQueue = new (std::nothrow) MessageQueueSync(kNumElementsInQueue,
+                                                     false /* configureEventFlagWord */,
+                                                     android::hardware::kMQPowerOfTwoCapacity);
+        ASSERT_NE(nullptr, mQueue);
+        ASSERT_TRUE(mQueue->isValid());
+        mNumMessagesMax = mQueue->getQuantumCount();
+    }
+
+    MessageQueueSync* mQueue = nullptr;
+    size_t mNumMessagesMax = 0;
+};
+
 /*
  * Utility function to initialize data to be written to the FMQ
  */
@@ -205,6 +236,468 @@ TEST_F(BadQueueConfig, QueueSizeTooLarge) {
     ASSERT_FALSE(fmq->isValid());
 }
 
+/*
+ * Verify that the capacity is rounded up to a power of two and that the
+ * option is recorded in the MQDescriptor.
+ */
+TEST_F(PowerOfTwoCapacity, CapacityRoundedUp) {
+    ASSERT_EQ(4096UL, mNumMessagesMax);
+    ASSERT_EQ(4096UL, mQueue->availableToWrite());
+    auto desc = mQueue->getDesc();
+    ASSERT_NE(0U, desc->grantors()[MessageQueueSync::Descriptor::DATAPTRPOS].flags &
+                          android::hardware::kMQPowerOfTwoCapacity);
+}
+
+/*
+ * Verify that wrap arounds are handled correctly when ring buffer offsets are
+ * computed using a mask.
+ */
+TEST_F(PowerOfTwoCapacity, ReadWriteWrapAround) {
+    size_t numMessages = mNumMessagesMax - 1;
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], numMessages));
+    ASSERT_TRUE(mQueue->read(&readData[0], numMessages));
+
+    MessageQueueSync::MemTransaction tx;
+    ASSERT_TRUE(mQueue->beginWrite(mNumMessagesMax, &tx));
+    ASSERT_EQ(1UL, tx.getFirstRegion().getLength());
+    ASSERT_EQ(mNumMessagesMax - 1, tx.getSecondRegion().getLength());
+    ASSERT_TRUE(tx.copyTo(&data[0], 0 /* startIdx */, mNumMessagesMax));
+    ASSERT_TRUE(mQueue->commitWrite(mNumMessagesMax));
+
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
+    ASSERT_EQ(data, readData);
+}
+
+/*
+ * Verify that with kMQCacheLineIsolation the counters and the EventFlag word
+ * are on separate cache lines and that a second MessageQueue object created
+ * from the MQDescriptor can read the data written by the first one.
+ */
+TEST(CacheLineIsolation, GrantorLayout) {
+    static constexpr size_t kNumElementsInQueue = 2048;
+    static constexpr size_t kCacheLineSize = 64;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */,
+                            android::hardware::kMQCacheLineIsolation);
+    ASSERT_TRUE(writer.isValid());
+    ASSERT_EQ(kNumElementsInQueue, writer.getQuantumCount());
+
+    auto grantors = writer.getDesc()->grantors();
+    ASSERT_EQ(4UL, grantors.size());
+    for (size_t i = 0; i < grantors.size(); i++) {
+        ASSERT_EQ(0U, grantors[i].offset % kCacheLineSize);
+        for (size_t j = i + 1; j < grantors.size(); j++) {
+            ASSERT_NE(grantors[i].offset / kCacheLineSize, grantors[j].offset / kCacheLineSize);
+        }
+    }
+
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+    ASSERT_NE(nullptr, reader.getEventFlagWord());
+
+    const size_t dataLen = 16;
+    uint8_t data[dataLen];
+    initData(data, dataLen);
+    ASSERT_TRUE(writer.write(data, dataLen));
+    uint8_t readData[dataLen] = {};
+    ASSERT_TRUE(reader.read(readData, dataLen));
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+    ASSERT_EQ(0UL, writer.availableToRead());
+}
+
+/*
+ * Verify that with kMQMirroredRing a write and a read that wrap around the end
+ * of the ring buffer are described by a single MemRegion, both for the
+ * MessageQueue object which created the FMQ and for one created from its
+ * MQDescriptor.
+ */
+TEST(MirroredRing, WrapAroundIsContiguous) {
+    static constexpr size_t kNumElementsInQueue = 2049;
+    MessageQueueSync writer(kNumElementsInQueue, false /* configureEventFlagWord */,
+                            android::hardware::kMQMirroredRing);
+    ASSERT_TRUE(writer.isValid());
+    ASSERT_TRUE(writer.isRingMirrored());
+    size_t numMessagesMax = writer.getQuantumCount();
+    ASSERT_LE(kNumElementsInQueue, numMessagesMax);
+    ASSERT_EQ(0UL, numMessagesMax % PAGE_SIZE);
+
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+    ASSERT_TRUE(reader.isRingMirrored());
+
+    std::vector<uint8_t> data(numMessagesMax);
+    std::vector<uint8_t> readData(numMessagesMax);
+    initData(&data[0], numMessagesMax);
+    ASSERT_TRUE(writer.write(&data[0], numMessagesMax - 1));
+    ASSERT_TRUE(reader.read(&readData[0], numMessagesMax - 1));
+
+    MessageQueueSync::MemTransaction tx;
+    ASSERT_TRUE(writer.beginWrite(numMessagesMax, &tx));
+    ASSERT_EQ(numMessagesMax, tx.getFirstRegion().getLength());
+    ASSERT_EQ(0UL, tx.getSecondRegion().getLength());
+    memcpy(tx.getFirstRegion().getAddress(), &data[0], numMessagesMax);
+    ASSERT_TRUE(writer.commitWrite(numMessagesMax));
+
+    ASSERT_TRUE(reader.beginRead(numMessagesMax, &tx));
+    ASSERT_EQ(numMessagesMax, tx.getFirstRegion().getLength());
+    ASSERT_EQ(0UL, tx.getSecondRegion().getLength());
+    ASSERT_EQ(0, memcmp(tx.getFirstRegion().getAddress(), &data[0], numMessagesMax));
+    ASSERT_TRUE(reader.commitRead(numMessagesMax));
+}
+
+/*
+ * Verify that a mirrored ring buffer is not mapped a third time by the mapping
+ * of the grantors which follow it, here the statistics grantor.
+ */
+TEST(MirroredRing, GrantorsAfterRing) {
+    MessageQueueSync fmq(PAGE_SIZE, true /* configureEventFlagWord */,
+                         android::hardware::kMQMirroredRing | android::hardware::kMQStatistics |
+                                 android::hardware::kMQMemfd);
+    ASSERT_TRUE(fmq.isValid());
+    ASSERT_TRUE(fmq.isRingMirrored());
+    android::hardware::MQStats stats;
+    ASSERT_TRUE(fmq.getStats(&stats));
+
+    /*
+     * The metadata in front of the ring buffer and the statistics grantor
+     * after it take a page each, the ring buffer is mapped twice.
+     */
+    size_t mappedBytes = 0;
+    FILE* maps = fopen("/proc/self/maps", "r");
+    ASSERT_NE(nullptr, maps);
+    char line[512];
+    while (fgets(line, sizeof(line), maps) != nullptr) {
+        unsigned long start, end;
+        if (strstr(line, "memfd:MessageQueue") != nullptr &&
+            sscanf(line, "%lx-%lx", &start, &end) == 2) {
+            mappedBytes += end - start;
+        }
+    }
+    fclose(maps);
+    ASSERT_EQ(2 * fmq.getQuantumCount() + 2 * PAGE_SIZE, mappedBytes);
+}
+
+/*
+ * Verify that an FMQ backed by a memfd can be shared through its MQDescriptor
+ * and that the size of the memfd is sealed.
+ */
+TEST(SharedMemoryBackend, Memfd) {
+    static constexpr size_t kNumElementsInQueue = 2048;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */,
+                            android::hardware::kMQMemfd);
+    ASSERT_TRUE(writer.isValid());
+    int fd = writer.getDesc()->handle()->data[0];
+    ASSERT_NE(0, ftruncate(fd, 0));
+    ASSERT_EQ(EPERM, errno);
+
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    const size_t dataLen = 16;
+    uint8_t data[dataLen];
+    initData(data, dataLen);
+    ASSERT_TRUE(writer.write(data, dataLen));
+    uint8_t readData[dataLen] = {};
+    ASSERT_TRUE(reader.read(readData, dataLen));
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+}
+
+/*
+ * Verify that an FMQ backed by huge pages works if the system can provide
+ * them, and that all of its mappings are released when it is destroyed.
+ * Creating it fails cleanly otherwise.
+ */
+TEST(SharedMemoryBackend, HugePages) {
+    static constexpr size_t kNumElementsInQueue = 4096;
+    auto queue = std::make_unique<MessageQueueSync>(
+            kNumElementsInQueue, true /* configureEventFlagWord */,
+            android::hardware::kMQHugePages);
+    if (!queue->isValid()) {
+        GTEST_SKIP() << "Huge pages are not available on this system";
+    }
+
+    std::vector<uint8_t> data(kNumElementsInQueue);
+    std::vector<uint8_t> readData(kNumElementsInQueue);
+    initData(&data[0], kNumElementsInQueue);
+    ASSERT_TRUE(queue->write(&data[0], kNumElementsInQueue));
+    ASSERT_TRUE(queue->read(&readData[0], kNumElementsInQueue));
+    ASSERT_EQ(data, readData);
+
+    queue.reset();
+    FILE* maps = fopen("/proc/self/maps", "r");
+    ASSERT_NE(nullptr, maps);
+    char line[512];
+    size_t mappings = 0;
+    while (fgets(line, sizeof(line), maps) != nullptr) {
+        if (strstr(line, "memfd:MessageQueue") != nullptr) {
+            mappings++;
+        }
+    }
+    fclose(maps);
+    ASSERT_EQ(0u, mappings);
+}
+
+/*
+ * Verify that the grantors which share an fd are mapped together, so that the
+ * distance between the ring buffer and the EventFlag word in memory is the
+ * same as in the fd, for a MessageQueue object created from the MQDescriptor
+ * as well.
+ */
+TEST(GrantorMapping, SingleMappingPerFd) {
+    static constexpr size_t kNumElementsInQueue = 2048;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */);
+    ASSERT_TRUE(writer.isValid());
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    auto grantors = writer.getDesc()->grantors();
+    ptrdiff_t expectedDistance =
+            static_cast<ptrdiff_t>(grantors[MessageQueueSync::Descriptor::EVFLAGWORDPOS].offset) -
+            static_cast<ptrdiff_t>(grantors[MessageQueueSync::Descriptor::DATAPTRPOS].offset);
+    for (MessageQueueSync* queue : {&writer, &reader}) {
+        MessageQueueSync::MemTransaction tx;
+        ASSERT_TRUE(queue->beginWrite(1, &tx));
+        ASSERT_EQ(expectedDistance, reinterpret_cast<uint8_t*>(queue->getEventFlagWord()) -
+                                            tx.getFirstRegion().getAddress());
+    }
+}
+
+/*
+ * Verify that an FMQ mapped with kMQPrefault and kMQLockMemory is usable
+ * whether or not the mappings could be locked, and that the mapping options
+ * can also be requested by a MessageQueue object created from the
+ * MQDescriptor.
+ */
+TEST(MappingOptions, PrefaultAndLock) {
+    static constexpr size_t kNumElementsInQueue = 2048;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */,
+                            android::hardware::kMQPrefault | android::hardware::kMQLockMemory);
+    ASSERT_TRUE(writer.isValid());
+
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+    ASSERT_EQ(writer.isMemoryLocked(), reader.isMemoryLocked());
+
+    MessageQueueSync unlocked(kNumElementsInQueue);
+    ASSERT_TRUE(unlocked.isValid());
+    ASSERT_FALSE(unlocked.isMemoryLocked());
+    MessageQueueSync prefaulted(*unlocked.getDesc(), false /* resetPointers */,
+                                android::hardware::kMQPrefault);
+    ASSERT_TRUE(prefaulted.isValid());
+    ASSERT_FALSE(prefaulted.isMemoryLocked());
+
+    const size_t dataLen = 16;
+    uint8_t data[dataLen];
+    initData(data, dataLen);
+    ASSERT_TRUE(writer.write(data, dataLen));
+    uint8_t readData[dataLen] = {};
+    ASSERT_TRUE(reader.read(readData, dataLen));
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+}
+
+/*
+ * Verify that the statistics grantor counts the transfers, the failed
+ * transfers, the blocking waits and the wakes of both sides, and that every
+ * process attached to the FMQ sees the same statistics.
+ */
+TEST(Statistics, SharedView) {
+    static constexpr size_t kNumElementsInQueue = 64;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */,
+                            android::hardware::kMQStatistics);
+    ASSERT_TRUE(writer.isValid());
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    uint8_t data[kNumElementsInQueue];
+    initData(data, kNumElementsInQueue);
+    uint8_t readData[kNumElementsInQueue];
+
+    ASSERT_FALSE(reader.read(readData, 1));
+    ASSERT_TRUE(writer.write(data, kNumElementsInQueue));
+    ASSERT_FALSE(writer.write(data, 1));
+    ASSERT_TRUE(reader.read(readData, kNumElementsInQueue / 2));
+    ASSERT_TRUE(reader.readBlocking(readData, kNumElementsInQueue / 2));
+    /*
+     * Times out after one wait, then after spinning and waiting: each
+     * blocking call counts one unavailable event.
+     */
+    ASSERT_FALSE(reader.readBlocking(readData, 1, 1000000 /* timeOutNanos */));
+    reader.setSpinWait(1000000 /* maxSpinNanos */);
+    ASSERT_FALSE(reader.readBlocking(readData, 1, 5000000 /* timeOutNanos */));
+
+    android::hardware::MQStats stats;
+    for (MessageQueueSync* queue : {&writer, &reader}) {
+        ASSERT_TRUE(queue->getStats(&stats));
+        ASSERT_EQ(kNumElementsInQueue, stats.writer.messages);
+        ASSERT_EQ(kNumElementsInQueue, stats.writer.bytes);
+        ASSERT_EQ(1UL, stats.writer.unavailableEvents);
+        ASSERT_EQ(kNumElementsInQueue, stats.reader.messages);
+        ASSERT_EQ(kNumElementsInQueue, stats.reader.bytes);
+        ASSERT_EQ(3UL, stats.reader.unavailableEvents);
+        ASSERT_EQ(1UL, stats.reader.wakes);
+        ASSERT_LE(1UL, stats.reader.blockingWaits);
+        uint64_t waits = 0;
+        for (uint64_t count : stats.reader.waitTimeHistogram) {
+            waits += count;
+        }
+        ASSERT_EQ(stats.reader.blockingWaits, waits);
+    }
+
+    MessageQueueSync noStats(kNumElementsInQueue);
+    ASSERT_FALSE(noStats.getStats(&stats));
+
+    MessageQueueMpmc mpmc(kNumElementsInQueue, false /* configureEventFlagWord */,
+                          android::hardware::kMQStatistics);
+    ASSERT_TRUE(mpmc.isValid());
+    uint32_t item = 1;
+    ASSERT_TRUE(mpmc.write(&item));
+    ASSERT_TRUE(mpmc.read(&item));
+    ASSERT_TRUE(mpmc.getStats(&stats));
+    ASSERT_EQ(1UL, stats.writer.messages);
+    ASSERT_EQ(sizeof(item), stats.reader.bytes);
+}
+
+/*
+ * Verify that the wakes statistic only counts the wakes which made the futex
+ * syscall: not the ones for bits which are already set, nor, with waiter
+ * tracking, the ones nobody waits for.
+ */
+TEST(Statistics, SkippedWakes) {
+    static constexpr size_t kNumElementsInQueue = 64;
+    uint8_t data[kNumElementsInQueue];
+    initData(data, kNumElementsInQueue);
+    android::hardware::MQStats stats;
+
+    MessageQueueSync fmq(kNumElementsInQueue, true /* configureEventFlagWord */,
+                         android::hardware::kMQStatistics);
+    ASSERT_TRUE(fmq.isValid());
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_TRUE(fmq.getStats(&stats));
+    ASSERT_EQ(1UL, stats.writer.wakes);
+
+    MessageQueueSync tracking(kNumElementsInQueue, true /* configureEventFlagWord */,
+                              android::hardware::kMQStatistics |
+                                      android::hardware::kMQEventFlagWaiterTracking);
+    ASSERT_TRUE(tracking.isValid());
+    ASSERT_TRUE(tracking.writeBlocking(data, 1));
+    ASSERT_TRUE(tracking.getStats(&stats));
+    ASSERT_EQ(0UL, stats.writer.wakes);
+}
+
+/*
+ * Store 'readPtr' and 'writePtr' into the 32 bit read and write pointer
+ * counters of the FMQ described by 'desc' through a mapping of its own.
+ */
+template <typename Descriptor>
+static void setCounters32(const Descriptor& desc, uint32_t readPtr, uint32_t writePtr) {
+    auto grantors = desc.grantors();
+    size_t length = std::max(grantors[Descriptor::READPTRPOS].offset,
+                             grantors[Descriptor::WRITEPTRPOS].offset) +
+            sizeof(uint64_t);
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, desc.handle()->data[0],
+                      0 /* offset */);
+    ASSERT_NE(MAP_FAILED, base);
+    reinterpret_cast<std::atomic<uint32_t>*>(static_cast<uint8_t*>(base) +
+                                             grantors[Descriptor::READPTRPOS].offset)
+            ->store(readPtr);
+    reinterpret_cast<std::atomic<uint32_t>*>(static_cast<uint8_t*>(base) +
+                                             grantors[Descriptor::WRITEPTRPOS].offset)
+            ->store(writePtr);
+    munmap(base, length);
+}
+
+/*
+ * Verify that reads and writes across the wrap around of 32 bit counters
+ * see the right amount of space and data, for endpoints which attach to the
+ * FMQ once the counters are close to their wrap around.
+ */
+TEST(CounterWidth, Wrap32Bit) {
+    static constexpr size_t kNumElementsInQueue = 1000;
+    MessageQueueSync queue(kNumElementsInQueue, false /* configureEventFlagWord */,
+                           android::hardware::kMQ32BitCounters);
+    ASSERT_TRUE(queue.isValid());
+    const size_t numMessagesMax = queue.getQuantumCount();
+    ASSERT_EQ(1024UL, numMessagesMax);
+
+    const uint32_t start = UINT32_MAX - 100;
+    setCounters32(*queue.getDesc(), start, start);
+    MessageQueueSync writer(*queue.getDesc(), false /* resetPointers */);
+    MessageQueueSync reader(*queue.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(writer.isValid());
+    ASSERT_TRUE(reader.isValid());
+    ASSERT_EQ(0UL, reader.availableToRead());
+    ASSERT_EQ(numMessagesMax, writer.availableToWrite());
+
+    std::vector<uint8_t> data(numMessagesMax);
+    std::vector<uint8_t> readData(numMessagesMax);
+    initData(&data[0], numMessagesMax);
+    for (size_t i = 0; i < 3; i++) {
+        ASSERT_TRUE(writer.write(&data[0], numMessagesMax));
+        ASSERT_FALSE(writer.write(&data[0], 1));
+        ASSERT_EQ(numMessagesMax, reader.availableToRead());
+        ASSERT_TRUE(reader.read(&readData[0], numMessagesMax));
+        ASSERT_FALSE(reader.read(&readData[0], 1));
+        ASSERT_EQ(data, readData);
+    }
+}
+
+/*
+ * Verify that an unsynchronized reader detects an overflow across the wrap
+ * around of 32 bit counters.
+ */
+TEST(CounterWidth, Overflow32Bit) {
+    static constexpr size_t kNumElementsInQueue = 1024;
+    MessageQueueUnsync writer(kNumElementsInQueue, false /* configureEventFlagWord */,
+                              android::hardware::kMQ32BitCounters);
+    ASSERT_TRUE(writer.isValid());
+    setCounters32(*writer.getDesc(), 0, UINT32_MAX - 100);
+    MessageQueueUnsync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    std::vector<uint8_t> data(kNumElementsInQueue);
+    std::vector<uint8_t> readData(kNumElementsInQueue);
+    initData(&data[0], kNumElementsInQueue);
+
+    /*
+     * The reader starts out with a read pointer counter of 0, which is
+     * detected as an overflow and makes it skip to the write pointer counter.
+     */
+    ASSERT_FALSE(reader.read(&readData[0], 1));
+    ASSERT_TRUE(writer.write(&data[0], kNumElementsInQueue / 2));
+    ASSERT_TRUE(reader.read(&readData[0], kNumElementsInQueue / 2));
+    ASSERT_TRUE(std::equal(readData.begin(), readData.begin() + kNumElementsInQueue / 2,
+                           data.begin()));
+
+    ASSERT_TRUE(writer.write(&data[0], kNumElementsInQueue));
+    ASSERT_TRUE(writer.write(&data[0], 1));
+    ASSERT_FALSE(reader.read(&readData[0], 1));
+    ASSERT_EQ(0UL, reader.availableToRead());
+}
+
+/*
+ * Verify that 32 bit counters are rejected when the ring buffer size cannot
+ * be a power of two and by the multi-producer flavors.
+ */
+TEST(CounterWidth, Unsupported32Bit) {
+    struct Item {
+        uint8_t data[12];
+    };
+    android::hardware::MessageQueue<Item, android::hardware::kSynchronizedReadWrite> odd(
+            16, false /* configureEventFlagWord */, android::hardware::kMQ32BitCounters);
+    ASSERT_FALSE(odd.isValid());
+
+    MessageQueueMpsc mpsc(16, false /* configureEventFlagWord */,
+                          android::hardware::kMQ32BitCounters);
+    ASSERT_FALSE(mpsc.isValid());
+
+    MessageQueueSpmc spmc(16, false /* configureEventFlagWord */,
+                          android::hardware::kMQ32BitCounters);
+    ASSERT_TRUE(spmc.isValid());
+}
+
 /*
  * Test that basic blocking works. This test uses the non-blocking read()/write()
  * APIs.
@@ -273,6 +766,55 @@ TEST_F(BlockingReadWrites, SmallInputTest2) {
     ASSERT_EQ(android::NO_ERROR, status);
 }
 
+/*
+ * Test that readUpToBlocking() returns as soon as some data is available and
+ * that it times out on an empty queue.
+ */
+TEST_F(QueueSizeOdd, ReadUpToBlocking) {
+    const size_t dataLen = 64;
+    uint8_t data[dataLen] = {0};
+    uint8_t readData[2 * dataLen];
+
+    ASSERT_EQ(0UL, mQueue->readUpToBlocking(readData, sizeof(readData),
+                                            100000000 /* timeOutNanos */));
+
+    std::thread Writer([&]() {
+        struct timespec waitTime = {0, 100 * 1000000};
+        ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+        ASSERT_EQ(dataLen, mQueue->writeUpToBlocking(data, dataLen,
+                                                     5000000000 /* timeOutNanos */));
+    });
+    ASSERT_EQ(dataLen, mQueue->readUpToBlocking(readData, sizeof(readData),
+                                                5000000000 /* timeOutNanos */));
+    Writer.join();
+}
+
+/*
+ * Test that the blocking methods still transfer data and time out as intended
+ * when they spin before waiting on the EventFlag.
+ */
+TEST_F(QueueSizeOdd, SpinWait) {
+    const size_t dataLen = 64;
+    uint8_t data[dataLen];
+    uint8_t readData[dataLen] = {0};
+    initData(data, dataLen);
+    mQueue->setSpinWait(100000 /* maxSpinNanos */);
+
+    ASSERT_FALSE(mQueue->readBlocking(readData, dataLen, 10000000 /* timeOutNanos */));
+
+    for (int i = 0; i < 2; i++) {
+        std::thread Writer([&]() {
+            struct timespec waitTime = {0, (i == 0 ? 20 : 100) * 1000};
+            ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+            ASSERT_TRUE(mQueue->writeBlocking(data, dataLen, 5000000000 /* timeOutNanos */));
+        });
+        ASSERT_TRUE(mQueue->readBlocking(readData, dataLen, 5000000000 /* timeOutNanos */));
+        Writer.join();
+        ASSERT_EQ(0, memcmp(data, readData, dataLen));
+        memset(readData, 0, dataLen);
+    }
+}
+
 /*
  * Test that basic blocking times out as intended.
  */
@@ -297,6 +839,500 @@ TEST_F(BlockingReadWrites, BlockingTimeOutTest) {
     ASSERT_EQ(android::NO_ERROR, status);
 }
 
+/*
+ * Test that waitUntil() times out at an absolute deadline.
+ */
+TEST_F(BlockingReadWrites, BlockingDeadlineTest) {
+    android::hardware::EventFlag* efGroup = nullptr;
+    android::status_t status = android::hardware::EventFlag::createEventFlag(&mFw, &efGroup);
+
+    ASSERT_EQ(android::NO_ERROR, status);
+    ASSERT_NE(nullptr, efGroup);
+
+    /* Block on an EventFlag bit that no one will wake until 100ms from now */
+    uint32_t efState = 0;
+    int64_t deadlineNanos = systemTime(SYSTEM_TIME_MONOTONIC) + 100000000;
+    android::status_t ret = efGroup->waitUntil(kFmqNotEmpty, &efState, deadlineNanos,
+                                               true /* retry */);
+    EXPECT_EQ(android::TIMED_OUT, ret);
+    EXPECT_GE(systemTime(SYSTEM_TIME_MONOTONIC), deadlineNanos);
+
+    /* A deadline in the past times out right away, and so does a negative one */
+    ret = efGroup->waitUntil(kFmqNotEmpty, &efState, deadlineNanos);
+    EXPECT_EQ(android::TIMED_OUT, ret);
+    ret = efGroup->waitUntil(kFmqNotEmpty, &efState, -1 /* deadlineNanoSeconds */);
+    EXPECT_EQ(android::TIMED_OUT, ret);
+
+    status = android::hardware::EventFlag::deleteEventFlag(&efGroup);
+    ASSERT_EQ(android::NO_ERROR, status);
+}
+
+/*
+ * Test that readBlockingUntil(), writeBlockingUntil() and their UpTo
+ * variants transfer data before the deadline and fail once it has passed,
+ * and that a past or negative deadline fails without waiting.
+ */
+TEST_F(QueueSizeOdd, BlockingUntil) {
+    const size_t dataLen = 64;
+    uint8_t data[dataLen];
+    uint8_t readData[dataLen] = {0};
+    initData(data, dataLen);
+
+    int64_t deadlineNanos = systemTime(SYSTEM_TIME_MONOTONIC) + 10000000;
+    ASSERT_FALSE(mQueue->readBlockingUntil(readData, dataLen, deadlineNanos));
+    ASSERT_GE(systemTime(SYSTEM_TIME_MONOTONIC), deadlineNanos);
+
+    std::thread Writer([&]() {
+        struct timespec waitTime = {0, 10 * 1000000};
+        ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+        ASSERT_TRUE(mQueue->writeBlockingUntil(
+                data, dataLen, systemTime(SYSTEM_TIME_MONOTONIC) + 5000000000));
+    });
+    ASSERT_TRUE(mQueue->readBlockingUntil(readData, dataLen,
+                                          systemTime(SYSTEM_TIME_MONOTONIC) + 5000000000));
+    Writer.join();
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+
+    ASSERT_EQ(0u, mQueue->readUpToBlockingUntil(readData, dataLen, deadlineNanos));
+    ASSERT_FALSE(mQueue->readBlockingUntil(readData, dataLen, -1 /* deadlineNanos */));
+    ASSERT_FALSE(mQueue->readBlocking(readData, dataLen, -1 /* timeOutNanos */));
+    ASSERT_EQ(dataLen, mQueue->writeUpToBlockingUntil(data, dataLen, deadlineNanos));
+    ASSERT_EQ(dataLen, mQueue->readUpToBlockingUntil(readData, 2 * dataLen,
+                                                     systemTime(SYSTEM_TIME_MONOTONIC) +
+                                                             5000000000));
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+
+    std::vector<uint8_t> fill(mNumMessagesMax);
+    ASSERT_TRUE(mQueue->writeBlockingUntil(&fill[0], mNumMessagesMax, 0 /* deadlineNanos */));
+    ASSERT_FALSE(mQueue->writeBlockingUntil(data, 1, systemTime(SYSTEM_TIME_MONOTONIC) + 10000000));
+    ASSERT_EQ(0u, mQueue->writeUpToBlockingUntil(data, 1, -1 /* deadlineNanos */));
+}
+
+/*
+ * Test that an EventFlag object tracking waiters registers a thread waiting
+ * on a bit in the flag word and unregisters it when waking it up.
+ */
+TEST_F(BlockingReadWrites, WaiterTracking) {
+    static constexpr uint32_t kWaiterShift = android::hardware::EventFlag::kWaiterBitsShift;
+    static constexpr uint32_t kTrackBit = android::hardware::EventFlag::kTrackWaitersBit;
+    std::atomic_init(&mFw, static_cast<uint32_t>(0));
+    android::hardware::EventFlag* efGroup = nullptr;
+    android::status_t status = android::hardware::EventFlag::createEventFlag(
+            &mFw, &efGroup, true /* trackWaiters */);
+    ASSERT_EQ(android::NO_ERROR, status);
+    ASSERT_NE(nullptr, efGroup);
+
+    /*
+     * Enabling waiter tracking registers a waiter on every bit, as threads
+     * may already be waiting. Nobody is, so start over from no waiters.
+     */
+    ASSERT_EQ(kTrackBit | (android::hardware::EventFlag::kEventBitsMask << kWaiterShift),
+              mFw.load());
+    mFw.store(kTrackBit);
+
+    /*
+     * Waking up without waiters only sets the bit.
+     */
+    bool syscalled = true;
+    ASSERT_EQ(android::NO_ERROR, efGroup->wake(kFmqNotFull, &syscalled));
+    ASSERT_FALSE(syscalled);
+    ASSERT_EQ(kTrackBit | kFmqNotFull, mFw.load());
+    uint32_t efState = 0;
+    ASSERT_EQ(android::NO_ERROR, efGroup->wait(kFmqNotFull, &efState));
+    ASSERT_EQ(static_cast<uint32_t>(kFmqNotFull), efState);
+    ASSERT_EQ(kTrackBit, mFw.load());
+
+    std::thread Waiter([&]() {
+        uint32_t waiterState = 0;
+        ASSERT_EQ(android::NO_ERROR, efGroup->wait(kFmqNotEmpty, &waiterState,
+                                                   5000000000 /* timeoutNanoSeconds */,
+                                                   true /* retry */));
+        ASSERT_EQ(static_cast<uint32_t>(kFmqNotEmpty), waiterState);
+    });
+    while (mFw.load() != (kTrackBit | kFmqNotEmpty << kWaiterShift)) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(android::NO_ERROR, efGroup->wake(kFmqNotEmpty));
+    Waiter.join();
+    ASSERT_EQ(kTrackBit, mFw.load());
+
+    /*
+     * The upper half of the word and bit 15 are reserved.
+     */
+    ASSERT_EQ(android::BAD_VALUE, efGroup->wake(1U << 15));
+    ASSERT_EQ(android::BAD_VALUE, efGroup->wake(1U << kWaiterShift));
+    ASSERT_EQ(android::BAD_VALUE, efGroup->wait(1U << kWaiterShift, &efState));
+
+    status = android::hardware::EventFlag::deleteEventFlag(&efGroup);
+    ASSERT_EQ(android::NO_ERROR, status);
+}
+
+/*
+ * Test blocking reads and writes in both directions on an FMQ whose
+ * EventFlag word tracks waiters.
+ */
+TEST(WaiterTracking, BlockingReadWrites) {
+    static constexpr size_t kNumElementsInQueue = 64;
+    static constexpr size_t kNumRounds = 1000;
+    MessageQueueSync fmq(kNumElementsInQueue, true /* configureEventFlagWord */,
+                         android::hardware::kMQEventFlagWaiterTracking);
+    ASSERT_TRUE(fmq.isValid());
+
+    std::thread Reader([&]() {
+        uint8_t data[kNumElementsInQueue];
+        for (size_t i = 0; i < kNumRounds; i++) {
+            ASSERT_TRUE(fmq.readBlocking(data, kNumElementsInQueue / 2,
+                                         5000000000 /* timeOutNanos */));
+            ASSERT_EQ(static_cast<uint8_t>(i), data[0]);
+        }
+    });
+    uint8_t data[kNumElementsInQueue];
+    for (size_t i = 0; i < kNumRounds; i++) {
+        memset(data, static_cast<uint8_t>(i), sizeof(data));
+        ASSERT_TRUE(fmq.writeBlocking(data, kNumElementsInQueue / 2,
+                                      5000000000 /* timeOutNanos */));
+    }
+    Reader.join();
+}
+
+/*
+ * Test that an EventFlag object created without waiter tracking, on the
+ * EventFlag word of an FMQ which tracks waiters, registers as a waiter so
+ * that the FMQ wakes it up. Also test that a thread which was already
+ * waiting when waiter tracking was enabled on a word gets woken up.
+ */
+TEST(WaiterTracking, NonTrackingWaiter) {
+    static constexpr uint32_t kNotEmpty = 0x02; /* FMQ_NOT_EMPTY */
+    MessageQueueSync fmq(16, true /* configureEventFlagWord */,
+                         android::hardware::kMQEventFlagWaiterTracking);
+    ASSERT_TRUE(fmq.isValid());
+    android::hardware::EventFlag* efGroup = nullptr;
+    ASSERT_EQ(android::NO_ERROR,
+              android::hardware::EventFlag::createEventFlag(fmq.getEventFlagWord(), &efGroup));
+
+    std::thread Reader([&]() {
+        uint32_t efState = 0;
+        ASSERT_EQ(android::NO_ERROR, efGroup->wait(kNotEmpty, &efState,
+                                                   5000000000 /* timeoutNanoSeconds */,
+                                                   true /* retry */));
+        uint8_t data = 0;
+        ASSERT_TRUE(fmq.read(&data));
+    });
+    while ((fmq.getEventFlagWord()->load() &
+            (kNotEmpty << android::hardware::EventFlag::kWaiterBitsShift)) == 0) {
+        std::this_thread::yield();
+    }
+    uint8_t data = 1;
+    ASSERT_TRUE(fmq.writeBlocking(&data, 1));
+    Reader.join();
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::deleteEventFlag(&efGroup));
+
+    std::atomic<uint32_t> efWord(0);
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::createEventFlag(&efWord, &efGroup));
+    std::thread Waiter([&]() {
+        uint32_t efState = 0;
+        ASSERT_EQ(android::NO_ERROR, efGroup->wait(kNotEmpty, &efState,
+                                                   5000000000 /* timeoutNanoSeconds */,
+                                                   true /* retry */));
+    });
+    /*
+     * Let the waiter block before enabling waiter tracking.
+     */
+    struct timespec waitTime = {0, 50 * 1000000};
+    ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+    android::hardware::EventFlag* trackingEfGroup = nullptr;
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::createEventFlag(
+                                         &efWord, &trackingEfGroup, true /* trackWaiters */));
+    bool syscalled = false;
+    ASSERT_EQ(android::NO_ERROR, trackingEfGroup->wake(kNotEmpty, &syscalled));
+    ASSERT_TRUE(syscalled);
+    Waiter.join();
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::deleteEventFlag(&trackingEfGroup));
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::deleteEventFlag(&efGroup));
+}
+
+/*
+ * Test that the wake policy defers the wake ups of the readers until one of
+ * its conditions holds, unless the write uses an EventFlag object of its
+ * own, and that deferred wake ups are flushed.
+ */
+TEST(WakePolicy, Coalescing) {
+    static constexpr uint32_t kNotEmpty = 0x02; /* FMQ_NOT_EMPTY */
+    MessageQueueSync fmq(16, true /* configureEventFlagWord */);
+    ASSERT_TRUE(fmq.isValid());
+    std::atomic<uint32_t>* evFlagWord = fmq.getEventFlagWord();
+    uint8_t data[16] = {0};
+
+    android::hardware::MQWakePolicy policy;
+    policy.minMessages = 4;
+    policy.highWatermark = 6;
+    policy.maxDelayNanos = 5000000000;
+    ASSERT_TRUE(fmq.setWakePolicy(policy));
+
+    /*
+     * 4 items written: the count condition holds on the second write.
+     */
+    ASSERT_TRUE(fmq.writeBlocking(data, 3));
+    ASSERT_EQ(0U, evFlagWord->load() & kNotEmpty);
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_EQ(kNotEmpty, evFlagWord->load() & kNotEmpty);
+    evFlagWord->fetch_and(~kNotEmpty);
+
+    /*
+     * 6 items in the FMQ: the watermark condition holds.
+     */
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_EQ(0U, evFlagWord->load() & kNotEmpty);
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_EQ(kNotEmpty, evFlagWord->load() & kNotEmpty);
+    evFlagWord->fetch_and(~kNotEmpty);
+    ASSERT_TRUE(fmq.read(data, fmq.availableToRead()));
+
+    ASSERT_TRUE(fmq.writeBlocking(data, 1));
+    ASSERT_EQ(0U, evFlagWord->load() & kNotEmpty);
+    fmq.flushNotifications();
+    ASSERT_EQ(kNotEmpty, evFlagWord->load() & kNotEmpty);
+    evFlagWord->fetch_and(~kNotEmpty);
+    ASSERT_TRUE(fmq.read(data, fmq.availableToRead()));
+
+    /*
+     * A write using an EventFlag object of its own is not deferred.
+     */
+    android::hardware::EventFlag* efGroup = nullptr;
+    ASSERT_EQ(android::NO_ERROR,
+              android::hardware::EventFlag::createEventFlag(evFlagWord, &efGroup));
+    ASSERT_TRUE(fmq.writeBlocking(data, 1, 0x01 /* FMQ_NOT_FULL */, kNotEmpty,
+                                  0 /* timeOutNanos */, efGroup));
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::deleteEventFlag(&efGroup));
+    ASSERT_EQ(kNotEmpty, evFlagWord->load() & kNotEmpty);
+    evFlagWord->fetch_and(~kNotEmpty);
+
+    /*
+     * A write which has to wait for space flushes the deferred wake up, so
+     * that the reader frees some.
+     */
+    policy.highWatermark = 0;
+    policy.minMessages = 16;
+    ASSERT_TRUE(fmq.setWakePolicy(policy));
+    ASSERT_TRUE(fmq.read(data, fmq.availableToRead()));
+    std::thread Reader([&]() {
+        uint8_t readData[16];
+        ASSERT_TRUE(fmq.readBlocking(readData, 8, 5000000000 /* timeOutNanos */));
+    });
+    ASSERT_TRUE(fmq.writeBlocking(data, 8));
+    ASSERT_TRUE(fmq.writeBlocking(data, 16, 5000000000 /* timeOutNanos */));
+    Reader.join();
+}
+
+/*
+ * Test that with a flush thread, the wake up deferred by the last write of a
+ * writer which stops writing is performed after the maximum delay of the
+ * wake policy, so that a reader blocked without a timeout gets the item.
+ */
+TEST(WakePolicy, MaxDelay) {
+    MessageQueueSync writer(16, true /* configureEventFlagWord */);
+    ASSERT_TRUE(writer.isValid());
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    android::hardware::MQWakePolicy policy;
+    policy.minMessages = 8;
+    policy.minIntervalNanos = 10000000;
+    policy.maxDelayNanos = 5000000;
+    ASSERT_FALSE(writer.setWakePolicy(policy));
+    policy.maxDelayNanos = -1;
+    ASSERT_FALSE(writer.setWakePolicy(policy));
+    policy.minIntervalNanos = 0;
+    policy.maxDelayNanos = 10000000;
+    policy.flushThread = true;
+    ASSERT_TRUE(writer.setWakePolicy(policy));
+
+    std::thread Reader([&]() {
+        uint8_t data = 0;
+        ASSERT_TRUE(reader.readBlocking(&data, 1, 0 /* timeOutNanos */));
+        ASSERT_EQ(1, data);
+    });
+    /*
+     * Let the reader block before writing.
+     */
+    struct timespec waitTime = {0, 50 * 1000000};
+    ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+    uint8_t data = 1;
+    int64_t writeNanos = systemTime(SYSTEM_TIME_MONOTONIC);
+    ASSERT_TRUE(writer.writeBlocking(&data, 1));
+    Reader.join();
+    ASSERT_GE(systemTime(SYSTEM_TIME_MONOTONIC) - writeNanos, 10000000);
+}
+
+/*
+ * Test that a wake policy with a minimum interval of 10 ms wakes the readers
+ * up at most about once per interval under a steady stream of writes, with
+ * and without a flush thread, and that the wake statistics count them all.
+ */
+TEST(WakePolicy, MinInterval) {
+    static constexpr uint32_t kNotEmpty = 0x02; /* FMQ_NOT_EMPTY */
+    static constexpr int64_t kIntervalNanos = 10000000;
+    static constexpr size_t kNumWrites = 50;
+    for (bool flushThread : {false, true}) {
+        MessageQueueSync fmq(16, true /* configureEventFlagWord */,
+                             android::hardware::kMQStatistics);
+        ASSERT_TRUE(fmq.isValid());
+        std::atomic<uint32_t>* evFlagWord = fmq.getEventFlagWord();
+
+        android::hardware::MQWakePolicy policy;
+        policy.minIntervalNanos = kIntervalNanos;
+        policy.flushThread = flushThread;
+        ASSERT_TRUE(fmq.setWakePolicy(policy));
+
+        /*
+         * Write an item every millisecond and count the wake ups by clearing
+         * the notification bit as a reader would.
+         */
+        size_t numWakes = 0;
+        int64_t startNanos = systemTime(SYSTEM_TIME_MONOTONIC);
+        for (size_t i = 0; i < kNumWrites; i++) {
+            uint8_t data = 0;
+            ASSERT_TRUE(fmq.writeBlocking(&data, 1));
+            ASSERT_TRUE(fmq.read(&data, 1));
+            if (evFlagWord->fetch_and(~kNotEmpty) & kNotEmpty) {
+                numWakes++;
+            }
+            struct timespec waitTime = {0, 1000000};
+            ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+        }
+        int64_t elapsedNanos = systemTime(SYSTEM_TIME_MONOTONIC) - startNanos;
+        /*
+         * Stop the flush thread, counting a wake up it performed after the
+         * last write.
+         */
+        ASSERT_TRUE(fmq.setWakePolicy(android::hardware::MQWakePolicy()));
+        if (evFlagWord->fetch_and(~kNotEmpty) & kNotEmpty) {
+            numWakes++;
+        }
+        ASSERT_LE(1U, numWakes);
+        ASSERT_GE(static_cast<size_t>(elapsedNanos / kIntervalNanos) + 2, numWakes);
+
+        /*
+         * Each wake up set the bit and made a syscall, including the ones
+         * of the flush thread concurrent with the writes.
+         */
+        android::hardware::MQStats stats;
+        ASSERT_TRUE(fmq.getStats(&stats));
+        ASSERT_EQ(numWakes, stats.writer.wakes);
+    }
+}
+
+/*
+ * Test that a wake policy high watermark is rejected for the unsynchronized
+ * flavor, whose writer cannot tell how full the FMQ is for its readers.
+ */
+TEST(WakePolicy, UnsynchronizedHighWatermark) {
+    MessageQueueUnsync fmq(16, true /* configureEventFlagWord */);
+    ASSERT_TRUE(fmq.isValid());
+    android::hardware::MQWakePolicy policy;
+    policy.highWatermark = 8;
+    ASSERT_FALSE(fmq.setWakePolicy(policy));
+    policy.highWatermark = 0;
+    policy.minMessages = 8;
+    ASSERT_TRUE(fmq.setWakePolicy(policy));
+}
+
+/*
+ * Test that a reader blocked until enough items are available is woken up
+ * once, by the write which makes them available, rather than by every write.
+ */
+TEST(ReadWakeThreshold, SingleWakeUp) {
+    static constexpr size_t kNumElementsInQueue = 64;
+    static constexpr size_t kNumWrites = 8;
+    MessageQueueSync writer(kNumElementsInQueue, true /* configureEventFlagWord */,
+                            android::hardware::kMQReadWakeThreshold |
+                                    android::hardware::kMQStatistics);
+    ASSERT_TRUE(writer.isValid());
+    MessageQueueSync reader(*writer.getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+
+    uint8_t data[kNumElementsInQueue];
+    initData(data, kNumElementsInQueue);
+    std::thread Reader([&]() {
+        uint8_t readData[kNumElementsInQueue];
+        ASSERT_TRUE(reader.readBlocking(readData, kNumElementsInQueue,
+                                        5000000000 /* timeOutNanos */));
+        ASSERT_EQ(0, memcmp(data, readData, kNumElementsInQueue));
+    });
+    /*
+     * Let the reader block before writing.
+     */
+    struct timespec waitTime = {0, 50 * 1000000};
+    ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+    for (size_t i = 0; i < kNumWrites; i++) {
+        ASSERT_TRUE(writer.writeBlocking(&data[i * kNumElementsInQueue / kNumWrites],
+                                         kNumElementsInQueue / kNumWrites));
+    }
+    Reader.join();
+
+    android::hardware::MQStats stats;
+    ASSERT_TRUE(writer.getStats(&stats));
+    ASSERT_EQ(1UL, stats.writer.wakes);
+    ASSERT_EQ(1UL, stats.reader.blockingWaits);
+}
+
+/*
+ * Test that a reader which waits on the EventFlag word without publishing a
+ * read threshold is woken up by the writes, and that wake policies, which
+ * would conflict with read thresholds, are rejected.
+ */
+TEST(ReadWakeThreshold, NonPublishingReader) {
+    static constexpr uint32_t kNotEmpty = 0x02; /* FMQ_NOT_EMPTY */
+    MessageQueueSync fmq(16, true /* configureEventFlagWord */,
+                         android::hardware::kMQReadWakeThreshold);
+    ASSERT_TRUE(fmq.isValid());
+    android::hardware::EventFlag* efGroup = nullptr;
+    ASSERT_EQ(android::NO_ERROR,
+              android::hardware::EventFlag::createEventFlag(fmq.getEventFlagWord(), &efGroup));
+
+    std::thread Reader([&]() {
+        uint32_t efState = 0;
+        ASSERT_EQ(android::NO_ERROR, efGroup->wait(kNotEmpty, &efState,
+                                                   5000000000 /* timeoutNanoSeconds */,
+                                                   true /* retry */));
+        uint8_t data = 0;
+        ASSERT_TRUE(fmq.read(&data));
+        ASSERT_EQ(1, data);
+    });
+    /*
+     * Let the reader block before writing.
+     */
+    struct timespec waitTime = {0, 50 * 1000000};
+    ASSERT_EQ(0, nanosleep(&waitTime, NULL));
+    uint8_t data = 1;
+    ASSERT_TRUE(fmq.writeBlocking(&data, 1));
+    Reader.join();
+    ASSERT_EQ(android::NO_ERROR, android::hardware::EventFlag::deleteEventFlag(&efGroup));
+
+    /*
+     * The readers decide when they are woken up, so wake policies are
+     * rejected.
+     */
+    android::hardware::MQWakePolicy policy;
+    policy.minMessages = 8;
+    ASSERT_FALSE(fmq.setWakePolicy(policy));
+    ASSERT_TRUE(fmq.setWakePolicy(android::hardware::MQWakePolicy()));
+}
+
+/*
+ * Verify that read wake thresholds are rejected by the multi-producer and
+ * multi-consumer flavors.
+ */
+TEST(ReadWakeThreshold, Unsupported) {
+    MessageQueueMpsc mpsc(16, true /* configureEventFlagWord */,
+                          android::hardware::kMQReadWakeThreshold);
+    ASSERT_FALSE(mpsc.isValid());
+
+    MessageQueueSpmc spmc(16, true /* configureEventFlagWord */,
+                          android::hardware::kMQReadWakeThreshold);
+    ASSERT_FALSE(spmc.isValid());
+}
+
 /*
  * Test that odd queue sizes do not cause unaligned error
  * on access to EventFlag object.
@@ -313,6 +1349,124 @@ TEST_F(QueueSizeOdd, EventFlagTest) {
     ASSERT_TRUE(ret);
 }
 
+/*
+ * Verify that the writers of a kMultiProducerMultiConsumer FMQ only reuse a
+ * slot once the item it held has been read, and that the readers do not read
+ * past an item which was reserved but not committed yet.
+ */
+TEST(MultiProducerMultiConsumer, SlotRecycling) {
+    MessageQueueMpmc queue(2);
+    ASSERT_TRUE(queue.isValid());
+
+    MessageQueueMpmc::MemTransaction first;
+    MessageQueueMpmc::MemTransaction second;
+    MessageQueueMpmc::MemTransaction third;
+    ASSERT_TRUE(queue.beginWrite(1, &first));
+    ASSERT_TRUE(queue.beginWrite(1, &second));
+    ASSERT_FALSE(queue.beginWrite(1, &third));
+    uint32_t firstValue = 1;
+    uint32_t secondValue = 2;
+    ASSERT_TRUE(first.copyTo(&firstValue, 0));
+    ASSERT_TRUE(second.copyTo(&secondValue, 0));
+    ASSERT_TRUE(queue.commitWrite(second));
+
+    uint32_t readData[2] = {};
+    ASSERT_FALSE(queue.read(readData, 1));
+    ASSERT_EQ(0UL, queue.readUpTo(readData, 2));
+
+    ASSERT_TRUE(queue.commitWrite(first));
+    ASSERT_EQ(0UL, queue.writeUpTo(&firstValue, 1));
+    ASSERT_TRUE(queue.read(readData, 1));
+    ASSERT_EQ(firstValue, readData[0]);
+
+    uint32_t thirdValue = 3;
+    ASSERT_EQ(1UL, queue.writeUpTo(&thirdValue, 2));
+    ASSERT_EQ(2UL, queue.readUpTo(readData, 2));
+    ASSERT_EQ(secondValue, readData[0]);
+    ASSERT_EQ(thirdValue, readData[1]);
+    ASSERT_EQ(0UL, queue.availableToRead());
+}
+
+/*
+ * Verify that a kMultiProducerMultiConsumer FMQ cannot hold a single item.
+ */
+TEST(MultiProducerMultiConsumer, SingleSlotInvalid) {
+    MessageQueueMpmc queue(1);
+    ASSERT_FALSE(queue.isValid());
+}
+
+/*
+ * Several blocking writers hand out items to several blocking readers of a
+ * kMultiProducerMultiConsumer FMQ. Verify that every item is read exactly
+ * once and that each reader receives the items of each writer in order.
+ */
+TEST(MultiProducerMultiConsumer, BlockingWritersAndReaders) {
+    static constexpr uint32_t kNumWriters = 4;
+    static constexpr uint32_t kNumReaders = 4;
+    static constexpr uint32_t kMessagesPerWriter = 5000;
+    static constexpr uint32_t kDone = UINT32_MAX;
+    static constexpr int64_t kTimeOutNanos = 5000000000;
+    MessageQueueMpmc queue(64, true /* configureEventFlagWord */);
+    ASSERT_TRUE(queue.isValid());
+
+    std::vector<std::vector<uint32_t>> received(kNumReaders);
+    std::vector<std::thread> readers;
+    for (uint32_t reader = 0; reader < kNumReaders; reader++) {
+        readers.emplace_back([&queue, &received, reader] {
+            uint32_t message;
+            while (queue.readBlocking(&message, 1, kTimeOutNanos) && message != kDone) {
+                received[reader].push_back(message);
+            }
+        });
+    }
+
+    std::vector<std::thread> writers;
+    std::atomic<uint32_t> failedWrites(0);
+    for (uint32_t writer = 0; writer < kNumWriters; writer++) {
+        writers.emplace_back([&queue, &failedWrites, writer] {
+            for (uint32_t i = 0; i < kMessagesPerWriter; i++) {
+                uint32_t message = (writer << 24) | i;
+                if (!queue.writeBlocking(&message, 1, kTimeOutNanos)) {
+                    failedWrites++;
+                }
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(0U, failedWrites.load());
+    for (uint32_t reader = 0; reader < kNumReaders; reader++) {
+        ASSERT_TRUE(queue.writeBlocking(&kDone, 1, kTimeOutNanos));
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    std::vector<uint32_t> all;
+    for (const auto& messages : received) {
+        std::vector<uint32_t> lastFromWriter(kNumWriters, 0);
+        std::vector<bool> seenWriter(kNumWriters, false);
+        for (uint32_t message : messages) {
+            uint32_t writer = message >> 24;
+            ASSERT_LT(writer, kNumWriters);
+            if (seenWriter[writer]) {
+                ASSERT_LT(lastFromWriter[writer], message & 0xffffff);
+            }
+            seenWriter[writer] = true;
+            lastFromWriter[writer] = message & 0xffffff;
+        }
+        all.insert(all.end(), messages.begin(), messages.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(kNumWriters * kMessagesPerWriter, all.size());
+    for (uint32_t writer = 0; writer < kNumWriters; writer++) {
+        for (uint32_t i = 0; i < kMessagesPerWriter; i++) {
+            ASSERT_EQ((writer << 24) | i, all[writer * kMessagesPerWriter + i]);
+        }
+    }
+}
+
 /*
  * Verify that a few bytes of data can be successfully written and read.
  */
@@ -639,6 +1793,434 @@ TEST_F(SynchronizedReadWrites, ReadWriteWrapAround2) {
     ASSERT_EQ(data, readData);
 }
 
+/*
+ * Verify that separate reader and writer endpoints pick up the progress of
+ * their peer once their cached copy of the peer's counter indicates that the
+ * FMQ is full or empty. The reader attaches after the counters have moved
+ * away from zero.
+ */
+TEST_F(SynchronizedReadWrites, SeparateEndpoints) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax / 2));
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax / 2));
+
+    MessageQueueSync reader(*mQueue->getDesc(), false /* resetPointers */);
+    ASSERT_TRUE(reader.isValid());
+    ASSERT_FALSE(reader.read(&readData[0], 1));
+
+    for (size_t i = 0; i < 3; i++) {
+        ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+        ASSERT_FALSE(mQueue->write(&data[0], 1));
+        ASSERT_TRUE(reader.read(&readData[0], mNumMessagesMax));
+        ASSERT_EQ(data, readData);
+        ASSERT_FALSE(reader.read(&readData[0], 1));
+    }
+}
+
+/*
+ * Verify that messages appended to a WriteBatch only become visible to the
+ * reader once the batch is committed, and that a batch cannot grow beyond the
+ * space reserved for it.
+ */
+TEST_F(SynchronizedReadWrites, WriteBatch) {
+    const size_t chunkSize = 10;
+    const size_t chunkNum = 5;
+    const size_t dataLen = chunkSize * chunkNum;
+    ASSERT_LE(dataLen, mNumMessagesMax);
+    uint8_t data[dataLen];
+    initData(data, dataLen);
+
+    MessageQueueSync::WriteBatch batch;
+    ASSERT_TRUE(mQueue->beginWriteBatch(dataLen, &batch));
+    for (size_t i = 0; i < chunkNum; i++) {
+        ASSERT_TRUE(batch.append(data + i * chunkSize, chunkSize));
+        ASSERT_EQ(0UL, mQueue->availableToRead());
+    }
+    ASSERT_EQ(dataLen, batch.size());
+    ASSERT_EQ(0UL, batch.available());
+    ASSERT_FALSE(batch.append(data));
+
+    ASSERT_TRUE(mQueue->commitWriteBatch(&batch));
+    ASSERT_EQ(dataLen, mQueue->availableToRead());
+    uint8_t readData[dataLen] = {};
+    ASSERT_TRUE(mQueue->read(readData, dataLen));
+    ASSERT_EQ(0, memcmp(data, readData, dataLen));
+}
+
+/*
+ * Verify that a WriteBatch which wraps around the end of the ring buffer is
+ * written correctly, and that beginWriteBatch() fails if the reservation
+ * does not fit.
+ */
+TEST_F(SynchronizedReadWrites, WriteBatchWrapAround) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax - 1));
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax - 1));
+
+    MessageQueueSync::WriteBatch batch;
+    ASSERT_FALSE(mQueue->beginWriteBatch(mNumMessagesMax + 1, &batch));
+    ASSERT_TRUE(mQueue->beginWriteBatch(mNumMessagesMax, &batch));
+    for (size_t i = 0; i < mNumMessagesMax; i++) {
+        ASSERT_TRUE(batch.append(&data[i]));
+    }
+    ASSERT_TRUE(mQueue->commitWriteBatch(&batch));
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
+    ASSERT_EQ(data, readData);
+}
+
+/*
+ * Verify that records which would wrap around the end of the ring buffer are
+ * preceded by padding and can be read in place, whether or not the padding is
+ * large enough to hold a skip marker.
+ */
+TEST_F(SynchronizedReadWrites, RecordWrapAround) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    const size_t recordLen = 100;
+    const size_t paddingLens[] = {2, 50};
+
+    MessageQueueSync::MemRegion record;
+    ASSERT_FALSE(mQueue->beginReadRecord(&record));
+    size_t offset = 0;
+    for (size_t paddingLen : paddingLens) {
+        size_t fillLen = mNumMessagesMax - paddingLen - offset;
+        ASSERT_TRUE(mQueue->write(&data[0], fillLen));
+        ASSERT_TRUE(mQueue->read(&readData[0], fillLen));
+        offset = sizeof(uint32_t) + recordLen;
+
+        ASSERT_TRUE(mQueue->writeRecord(&data[0], recordLen));
+        ASSERT_EQ(paddingLen + sizeof(uint32_t) + recordLen, mQueue->availableToRead());
+        ASSERT_TRUE(mQueue->beginReadRecord(&record));
+        ASSERT_EQ(recordLen, record.getLength());
+        ASSERT_EQ(0, memcmp(&data[0], record.getAddress(), recordLen));
+        ASSERT_TRUE(mQueue->commitReadRecord());
+        ASSERT_EQ(0UL, mQueue->availableToRead());
+    }
+}
+
+/*
+ * Verify that a record larger than half the ring buffer, which does not fit
+ * into the free space together with the padding in front of it, is written
+ * once the reader consumed the padding committed on its own.
+ */
+TEST(Records, LargeRecordWrapAround) {
+    static constexpr size_t kNumElementsInQueue = 64;
+    MessageQueueSync fmq(kNumElementsInQueue);
+    ASSERT_TRUE(fmq.isValid());
+    uint8_t data[kNumElementsInQueue];
+    initData(data, kNumElementsInQueue);
+    MessageQueueSync::MemRegion record;
+
+    ASSERT_TRUE(fmq.writeRecord(data, 28));
+    ASSERT_TRUE(fmq.beginReadRecord(&record));
+    ASSERT_TRUE(fmq.commitReadRecord());
+    ASSERT_EQ(kNumElementsInQueue, fmq.availableToWrite());
+
+    /*
+     * Only the padding up to the end of the ring buffer is written.
+     */
+    ASSERT_FALSE(fmq.writeRecord(data, 40));
+    ASSERT_EQ(kNumElementsInQueue - 32, fmq.availableToWrite());
+    ASSERT_FALSE(fmq.beginReadRecord(&record));
+    ASSERT_EQ(kNumElementsInQueue, fmq.availableToWrite());
+
+    ASSERT_TRUE(fmq.writeRecord(data, 40));
+    ASSERT_TRUE(fmq.beginReadRecord(&record));
+    ASSERT_EQ(40UL, record.getLength());
+    ASSERT_EQ(0, memcmp(data, record.getAddress(), 40));
+    ASSERT_TRUE(fmq.commitReadRecord());
+    ASSERT_FALSE(fmq.writeRecord(data, kNumElementsInQueue - 3));
+}
+
+/*
+ * Verify that records appended to a WriteBatch are published with a single
+ * commit and read back in order.
+ */
+TEST_F(SynchronizedReadWrites, RecordBatch) {
+    const size_t recordLens[] = {0, 1, 300};
+    std::vector<uint8_t> data(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+
+    MessageQueueSync::WriteBatch batch;
+    ASSERT_TRUE(mQueue->beginWriteBatch(mNumMessagesMax, &batch));
+    for (size_t recordLen : recordLens) {
+        ASSERT_TRUE(batch.appendRecord(&data[0], recordLen));
+    }
+    ASSERT_FALSE(batch.appendRecord(&data[0], mNumMessagesMax));
+
+    MessageQueueSync::MemRegion record;
+    ASSERT_FALSE(mQueue->beginReadRecord(&record));
+    ASSERT_TRUE(mQueue->commitWriteBatch(&batch));
+    for (size_t recordLen : recordLens) {
+        ASSERT_TRUE(mQueue->beginReadRecord(&record));
+        ASSERT_EQ(recordLen, record.getLength());
+        ASSERT_EQ(0, memcmp(&data[0], record.getAddress(), recordLen));
+        ASSERT_TRUE(mQueue->commitReadRecord());
+    }
+    ASSERT_FALSE(mQueue->beginReadRecord(&record));
+}
+
+/*
+ * Verify that writeUpTo() writes as many items as fit and readUpTo() reads as
+ * many items as are available.
+ */
+TEST_F(SynchronizedReadWrites, PartialReadWrite) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    const size_t dataLen = 100;
+
+    ASSERT_EQ(0UL, mQueue->readUpTo(&readData[0], dataLen));
+    ASSERT_EQ(dataLen, mQueue->writeUpTo(&data[0], dataLen));
+    ASSERT_EQ(mNumMessagesMax - dataLen, mQueue->writeUpTo(&data[dataLen], mNumMessagesMax));
+    ASSERT_EQ(0UL, mQueue->writeUpTo(&data[0], 1));
+
+    ASSERT_EQ(mNumMessagesMax - dataLen, mQueue->readUpTo(&readData[0], mNumMessagesMax - dataLen));
+    ASSERT_EQ(dataLen, mQueue->readUpTo(&readData[mNumMessagesMax - dataLen], mNumMessagesMax));
+    ASSERT_EQ(0UL, mQueue->readUpTo(&readData[0], 1));
+    ASSERT_EQ(data, readData);
+}
+
+/*
+ * Write and read back with the non-temporal and prefetching copy policies at
+ * an unaligned offset so that the copies have an unaligned head, a tail and
+ * a wrap around.
+ */
+TEST_F(SynchronizedReadWrites, CopyPolicies) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    const size_t offset = 7;
+
+    ASSERT_TRUE(mQueue->write(&data[0], offset));
+    ASSERT_TRUE(mQueue->read(&readData[0], offset));
+
+    mQueue->setCopyPolicy(android::hardware::kMQCopyNonTemporal,
+                          android::hardware::kMQCopyPrefetch);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
+    ASSERT_EQ(data, readData);
+
+    mQueue->setCopyPolicy(android::hardware::kMQCopyPrefetch,
+                          android::hardware::kMQCopyNonTemporal);
+    std::fill(readData.begin(), readData.end(), 0);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax - offset));
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax - offset));
+    ASSERT_TRUE(std::equal(readData.begin(), readData.end() - offset, data.begin()));
+}
+
+/*
+ * Write and read back across wrap arounds with prefetching enabled, including
+ * with a prefetch distance larger than the ring buffer.
+ */
+TEST_F(SynchronizedReadWrites, PrefetchWrapAround) {
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    const size_t dataLen = 100;
+
+    for (size_t distance : {size_t(256), mNumMessagesMax * 2}) {
+        mQueue->setPrefetchDistance(distance, distance);
+        for (size_t offset = 0; offset < 2 * mNumMessagesMax; offset += dataLen) {
+            ASSERT_TRUE(mQueue->write(&data[0], dataLen));
+            ASSERT_TRUE(mQueue->read(&readData[0], dataLen));
+            ASSERT_TRUE(std::equal(data.begin(), data.begin() + dataLen, readData.begin()));
+        }
+    }
+}
+
+/*
+ * Write and read items of a multi-word type one at a time and a few at a time
+ * across several wrap arounds, which use the inlined copies.
+ */
+TEST(SmallItemCopy, SingleAndFewItems) {
+    struct Item {
+        uint64_t a;
+        uint32_t b;
+        uint32_t c;
+        uint64_t d;
+    };
+    const size_t numElementsInQueue = 7;
+    android::hardware::MessageQueue<Item, android::hardware::kSynchronizedReadWrite> fmq(
+            numElementsInQueue);
+    ASSERT_TRUE(fmq.isValid());
+
+    uint64_t next = 0;
+    uint64_t expected = 0;
+    for (size_t count = 1; count <= 5; count++) {
+        for (size_t i = 0; i < 2 * numElementsInQueue; i++) {
+            Item items[5];
+            for (size_t j = 0; j < count; j++, next++) {
+                items[j] = {next, static_cast<uint32_t>(next), ~static_cast<uint32_t>(next), ~next};
+            }
+            if (count == 1) {
+                ASSERT_TRUE(fmq.write(&items[0]));
+            } else {
+                ASSERT_TRUE(fmq.write(items, count));
+            }
+
+            Item readItems[5] = {};
+            if (count == 1) {
+                ASSERT_TRUE(fmq.read(&readItems[0]));
+            } else {
+                ASSERT_TRUE(fmq.read(readItems, count));
+            }
+            for (size_t j = 0; j < count; j++, expected++) {
+                ASSERT_EQ(expected, readItems[j].a);
+                ASSERT_EQ(static_cast<uint32_t>(expected), readItems[j].b);
+                ASSERT_EQ(~static_cast<uint32_t>(expected), readItems[j].c);
+                ASSERT_EQ(~expected, readItems[j].d);
+            }
+        }
+    }
+    Item item;
+    ASSERT_FALSE(fmq.read(&item));
+}
+
+/*
+ * Verify that the reader of a kMultiProducerSingleConsumer FMQ does not read
+ * past an item which was reserved but not committed yet.
+ */
+TEST(MultiProducerSingleConsumer, UncommittedReservation) {
+    MessageQueueMpsc queue(16);
+    ASSERT_TRUE(queue.isValid());
+
+    MessageQueueMpsc::MemTransaction first;
+    MessageQueueMpsc::MemTransaction second;
+    ASSERT_TRUE(queue.beginWrite(1, &first));
+    ASSERT_TRUE(queue.beginWrite(1, &second));
+    uint32_t firstValue = 1;
+    uint32_t secondValue = 2;
+    ASSERT_TRUE(first.copyTo(&firstValue, 0));
+    ASSERT_TRUE(second.copyTo(&secondValue, 0));
+    ASSERT_TRUE(queue.commitWrite(second));
+
+    uint32_t readData[2] = {};
+    ASSERT_FALSE(queue.read(readData, 1));
+    ASSERT_EQ(0UL, queue.readUpTo(readData, 2));
+
+    ASSERT_TRUE(queue.commitWrite(first));
+    ASSERT_EQ(2UL, queue.readUpTo(readData, 2));
+    ASSERT_EQ(firstValue, readData[0]);
+    ASSERT_EQ(secondValue, readData[1]);
+}
+
+/*
+ * Several threads write into a kMultiProducerSingleConsumer FMQ concurrently.
+ * Verify that the reader receives every message exactly once and in the order
+ * in which each writer wrote them.
+ */
+TEST(MultiProducerSingleConsumer, ConcurrentWriters) {
+    static constexpr uint32_t kNumWriters = 4;
+    static constexpr uint32_t kMessagesPerWriter = 10000;
+    MessageQueueMpsc queue(64);
+    ASSERT_TRUE(queue.isValid());
+
+    std::vector<std::thread> writers;
+    for (uint32_t writer = 0; writer < kNumWriters; writer++) {
+        writers.emplace_back([&queue, writer] {
+            for (uint32_t i = 0; i < kMessagesPerWriter; i++) {
+                uint32_t message = (writer << 24) | i;
+                while (!queue.write(&message)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<uint32_t> nextExpected(kNumWriters);
+    for (uint32_t received = 0; received < kNumWriters * kMessagesPerWriter;) {
+        uint32_t message;
+        if (!queue.read(&message)) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t writer = message >> 24;
+        ASSERT_LT(writer, kNumWriters);
+        ASSERT_EQ(nextExpected[writer], message & 0xffffff);
+        nextExpected[writer]++;
+        received++;
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(0UL, queue.availableToRead());
+}
+
+/*
+ * Verify that an item claimed by one reader of a kSingleProducerMultiConsumer
+ * FMQ cannot be committed by another reader which started reading it.
+ */
+TEST(SingleProducerMultiConsumer, CompetingReaders) {
+    MessageQueueSpmc queue(16);
+    ASSERT_TRUE(queue.isValid());
+    uint32_t data[2] = {1, 2};
+    ASSERT_TRUE(queue.write(data, 2));
+
+    MessageQueueSpmc::MemTransaction first;
+    MessageQueueSpmc::MemTransaction second;
+    ASSERT_TRUE(queue.beginRead(1, &first));
+    ASSERT_TRUE(queue.beginRead(1, &second));
+    ASSERT_TRUE(queue.commitRead(second));
+    ASSERT_FALSE(queue.commitRead(first));
+
+    uint32_t readData = 0;
+    ASSERT_TRUE(queue.read(&readData));
+    ASSERT_EQ(data[1], readData);
+    ASSERT_EQ(0UL, queue.availableToRead());
+}
+
+/*
+ * A single writer hands out items to several blocking readers of a
+ * kSingleProducerMultiConsumer FMQ. Verify that every item is read exactly
+ * once.
+ */
+TEST(SingleProducerMultiConsumer, BlockingReaders) {
+    static constexpr uint32_t kNumReaders = 4;
+    static constexpr uint32_t kNumMessages = 20000;
+    static constexpr uint32_t kDone = UINT32_MAX;
+    static constexpr int64_t kTimeOutNanos = 5000000000;
+    MessageQueueSpmc queue(64, true /* configureEventFlagWord */);
+    ASSERT_TRUE(queue.isValid());
+
+    std::vector<std::vector<uint32_t>> received(kNumReaders);
+    std::vector<std::thread> readers;
+    for (uint32_t reader = 0; reader < kNumReaders; reader++) {
+        readers.emplace_back([&queue, &received, reader] {
+            uint32_t message;
+            while (queue.readBlocking(&message, 1, kTimeOutNanos) && message != kDone) {
+                received[reader].push_back(message);
+            }
+        });
+    }
+
+    for (uint32_t i = 0; i < kNumMessages; i++) {
+        ASSERT_TRUE(queue.writeBlocking(&i, 1, kTimeOutNanos));
+    }
+    for (uint32_t reader = 0; reader < kNumReaders; reader++) {
+        ASSERT_TRUE(queue.writeBlocking(&kDone, 1, kTimeOutNanos));
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    std::vector<uint32_t> all;
+    for (const auto& messages : received) {
+        ASSERT_TRUE(std::is_sorted(messages.begin(), messages.end()));
+        all.insert(all.end(), messages.begin(), messages.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(kNumMessages, all.size());
+    for (uint32_t i = 0; i < kNumMessages; i++) {
+        ASSERT_EQ(i, all[i]);
+    }
+}
+
 /*
  * Verify that a few bytes of data can be successfully written and read.
  */
@@ -807,3 +2389,112 @@ TEST_F(UnsynchronizedWrite, ReadWriteWrapAround) {
     ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
     ASSERT_EQ(data, readData);
 }
+
+/*
+ * Overflow the FMQ and verify that with kMQReadPositionOldest, the reader
+ * resumes from the oldest item still held by the ring buffer.
+ */
+TEST_F(UnsynchronizedWrite, OverflowReadOldest) {
+    const size_t extra = 10;
+    std::vector<uint8_t> data(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    ASSERT_TRUE(mQueue->write(&data[0], extra));
+
+    mQueue->setOverflowReadPosition(android::hardware::kMQReadPositionOldest);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    ASSERT_FALSE(mQueue->read(&readData[0], 1));
+    ASSERT_EQ(mNumMessagesMax, mQueue->availableToRead());
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
+    ASSERT_TRUE(std::equal(data.begin() + extra, data.end(), readData.begin()));
+    ASSERT_TRUE(std::equal(data.begin(), data.begin() + extra,
+                           readData.begin() + mNumMessagesMax - extra));
+}
+
+/*
+ * Overflow the FMQ and verify that with kMQReadPositionLag, the reader
+ * resumes the given number of items behind the writer.
+ */
+TEST_F(UnsynchronizedWrite, OverflowReadLag) {
+    const size_t extra = 10;
+    const size_t lag = 100;
+    std::vector<uint8_t> data(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    ASSERT_TRUE(mQueue->write(&data[0], extra));
+
+    mQueue->setOverflowReadPosition(android::hardware::kMQReadPositionLag, lag);
+    std::vector<uint8_t> readData(lag);
+    ASSERT_FALSE(mQueue->read(&readData[0], 1));
+    ASSERT_EQ(lag, mQueue->availableToRead());
+    ASSERT_TRUE(mQueue->read(&readData[0], lag));
+    ASSERT_TRUE(std::equal(data.end() - (lag - extra), data.end(), readData.begin()));
+    ASSERT_TRUE(std::equal(data.begin(), data.begin() + extra, readData.end() - extra));
+}
+
+/*
+ * Verify the position of readers attaching to the FMQ with an
+ * MQReadPosition, before and after the ring buffer was filled once.
+ */
+TEST_F(UnsynchronizedWrite, AttachPosition) {
+    const size_t dataLen = 10;
+    std::vector<uint8_t> data(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+    ASSERT_TRUE(mQueue->write(&data[0], dataLen));
+
+    MessageQueueUnsync oldest(*mQueue->getDesc(), android::hardware::kMQReadPositionOldest);
+    ASSERT_TRUE(oldest.isValid());
+    ASSERT_EQ(dataLen, oldest.availableToRead());
+
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    MessageQueueUnsync oldestAfterWrap(*mQueue->getDesc(),
+                                       android::hardware::kMQReadPositionOldest);
+    ASSERT_EQ(mNumMessagesMax, oldestAfterWrap.availableToRead());
+    MessageQueueUnsync lagging(*mQueue->getDesc(), android::hardware::kMQReadPositionLag,
+                               5 /* attachLag */);
+    ASSERT_EQ(5UL, lagging.availableToRead());
+    MessageQueueUnsync newest(*mQueue->getDesc(), android::hardware::kMQReadPositionNewest);
+    ASSERT_EQ(0UL, newest.availableToRead());
+
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    ASSERT_TRUE(oldestAfterWrap.read(&readData[0], mNumMessagesMax));
+    ASSERT_EQ(data, readData);
+}
+
+/*
+ * Verify that the overflow statistics count the overflows detected and the
+ * items skipped with the default and the oldest read positions.
+ */
+TEST_F(UnsynchronizedWrite, OverflowStats) {
+    const size_t extra = 10;
+    std::vector<uint8_t> data(mNumMessagesMax);
+    std::vector<uint8_t> readData(mNumMessagesMax);
+    initData(&data[0], mNumMessagesMax);
+
+    auto stats = mQueue->getReadOverflowStats();
+    ASSERT_EQ(0UL, stats.overflowCount);
+    ASSERT_EQ(0UL, stats.messagesLost);
+    ASSERT_EQ(0, stats.lastOverflowTimeNs);
+
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    ASSERT_TRUE(mQueue->write(&data[0], extra));
+    ASSERT_FALSE(mQueue->read(&readData[0], 1));
+    stats = mQueue->getReadOverflowStats();
+    ASSERT_EQ(1UL, stats.overflowCount);
+    ASSERT_EQ(mNumMessagesMax + extra, stats.messagesLost);
+    ASSERT_NE(0, stats.lastOverflowTimeNs);
+
+    mQueue->setOverflowReadPosition(android::hardware::kMQReadPositionOldest);
+    ASSERT_TRUE(mQueue->write(&data[0], mNumMessagesMax));
+    ASSERT_TRUE(mQueue->write(&data[0], extra));
+    ASSERT_FALSE(mQueue->read(&readData[0], 1));
+    stats = mQueue->getReadOverflowStats();
+    ASSERT_EQ(2UL, stats.overflowCount);
+    ASSERT_EQ(mNumMessagesMax + 2 * extra, stats.messagesLost);
+    ASSERT_TRUE(mQueue->read(&readData[0], mNumMessagesMax));
+
+    mQueue->resetReadOverflowStats();
+    stats = mQueue->getReadOverflowStats();
+    ASSERT_EQ(0UL, stats.overflowCount);
+    ASSERT_EQ(0UL, stats.messagesLost);
+}